@@ -5,6 +5,7 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
 ../gcode.c \
+../isr_timing.c \
 ../joystick.c \
 ../lcd.c \
 ../main.c \
@@ -17,10 +18,12 @@ C_SRCS += \
 ../stepper.c \
 ../tasks.c \
 ../temperature.c \
+../trapezoid.c \
 ../usb_serial_structs.c 
 
 OBJS += \
 ./gcode.o \
+./isr_timing.o \
 ./joystick.o \
 ./lcd.o \
 ./main.o \
@@ -33,10 +36,12 @@ OBJS += \
 ./stepper.o \
 ./tasks.o \
 ./temperature.o \
+./trapezoid.o \
 ./usb_serial_structs.o 
 
 C_DEPS += \
 ./gcode.d \
+./isr_timing.d \
 ./joystick.d \
 ./lcd.d \
 ./main.d \
@@ -49,6 +54,7 @@ C_DEPS += \
 ./stepper.d \
 ./tasks.d \
 ./temperature.d \
+./trapezoid.d \
 ./usb_serial_structs.d 
 
 
@@ -26,6 +26,10 @@
 // (must not contain capital letters)
 #define LASAURGRBL_VERSION "13.04.ums"
 //#define DEBUG_IGNORE_SENSORS  // set for debugging
+//#define DEBUG_STEP_LED        // light the blue launchpad LED while the stepper runs
+//#define CONFIG_ISR_TIMING     // measure the interrupt handlers with the cycle counter, M653 reports
+#define CONFIG_ISR_TIMING_LATE_US 2   // stepper ISR entries later than this past the timeout count as late
+#define CONFIG_STATUS_REPORT_MIN_MS 10  // shortest period of the pushed status report (M655 S<ms>)
 
 // Whether or not to drive an LCD.
 // #define ENABLE_LCD 	// NOTE: 	Eclipse seem weird, can't #define stuff in headers?
@@ -43,7 +47,9 @@
 #define CONFIG_MAX_FEEDRATE 25000.0 // in millimeters per minute
 #define CONFIG_MAX_SEEKRATE 25000.0
 #define CONFIG_DEFAULT_ACCELERATION 8000000.0 // mm/min^2, typically 1000000-8000000, divide by (60*60) to get mm/sec^2
+#define CONFIG_SEEK_ACCELERATION 16000000.0   // mm/min^2, moves with the laser off (G0, jogging, raster run-ups)
 #define CONFIG_JUNCTION_DEVIATION 0.006 // mm
+#define CONFIG_SEEK_JUNCTION_DEVIATION 0.02   // mm, corners between moves with the laser off
 #define CONFIG_X_ORIGIN_OFFSET 0.0  // mm, x-offset of table origin from physical home
 #define CONFIG_Y_ORIGIN_OFFSET 0.0  // mm, y-offset of table origin from physical home
 #define CONFIG_Z_ORIGIN_OFFSET 0.0   // mm, z-offset of table origin from physical home
@@ -53,28 +59,43 @@
 #define CONFIG_Y_MAX 215.0
 #define CONFIG_Z_MIN 0.0
 #define CONFIG_Z_MAX 50.0
+#define CONFIG_HOMING_SEEKRATE 7500.0 // mm/min, approaching the limit switches and backing off
+#define CONFIG_HOMING_FEEDRATE 380.0  // mm/min, locating the switches precisely
+#define CONFIG_HOMING_PULLOFF 5.0     // mm, the most a limit switch may take to release
+//#define CONFIG_DEFER_HOMING         // home on the first motion command (or G28) instead of at boot
 
 #define CONFIG_INVERT_X_AXIS 1  // 0 is regular, 1 inverts the x direction
 #define CONFIG_INVERT_Y_AXIS 1  // 0 is regular, 1 inverts the y direction
 #define CONFIG_INVERT_Z_AXIS 0  // 0 is regular, 1 inverts the y direction
 
-#define CONFIG_LASER_PWM_FREQ           40000
+#define CONFIG_LASER_PWM_FREQ           40000   // Hz, at boot, M652 S<Hz> changes it
+#define CONFIG_LASER_PWM_FREQ_MIN       10
+#define CONFIG_LASER_PWM_FREQ_MAX       100000  // 800 cycles per period at 80MHz
+
+// Laser power curve, PWM duty (0-255) for intensity 0, 32, 64, ... 224, 255.
+// Intensities in between are interpolated. Calibrate for non-linear tubes.
+#define CONFIG_LASER_POWER_CURVE        {0, 32, 64, 96, 128, 160, 192, 224, 255}
 
 #define CONFIG_LASER_PPI_PULSE_US       2500.0
 #define CONFIG_LASER_PPI_SPACE_US       500.0
 #define CONFIG_LASER_PPI_MAX_PPM        (60000000.0 / (CONFIG_LASER_PPI_PULSE_US + CONFIG_LASER_PPI_SPACE_US))
 
-// This will use a timer to guarantee a step pulse length.
-// However the maximum seek rate will be limited (approx. 15000mm/min)
-// Disabling this define will pulse for the duration of the stepper ISR (< 1us)
-// This works with Pololu drivers, and achieves >=30000mm/min.
+// This will use a timer to guarantee a step pulse length of CONFIG_PULSE_MICROSECONDS, for
+// drivers that need longer pulses. The timer ends the pulse through the uDMA, without an
+// interrupt, so it doesn't limit the seek rate.
+// Disabled, the pulse lasts for the rest of the stepper ISR (about 1us), enough for Pololu drivers.
 //#define CONFIG_STEPPER_USE_PULSE_TIMER
 
+// Adaptive multi-axis step smoothing. At low step rates the stepper interrupt runs at
+// up to 8 times the step rate, so the steps of the minor axes are spread evenly in time.
+#define CONFIG_STEPPER_AMASS
+
 // Interrupt Priorities (0 highest)
 #define CONFIG_STEPPER_PRIORITY     (0 << 5)
 #define CONFIG_LASER_PRIORITY       (1 << 5)
+#define CONFIG_SEGMENT_PRIORITY     (2 << 5)
 #define CONFIG_USB_PRIORITY         (2 << 5)
-#define CONFIG_SENSE_PRIORITY       (3 << 5)
+#define CONFIG_SENSE_PRIORITY       (1 << 5)   // ahead of the segment prep, it latches the sensors for the stepper
 #define CONFIG_JOY_PRIORITY         (4 << 5)
 #define CONFIG_GPTIMER_PRIORITY     (7 << 5)
 
@@ -94,6 +115,7 @@
 #define SENSE_PORT              GPIO_PORTE_BASE
 #define DOOR_BIT                1
 #define SENSE_MASK              (1<<DOOR_BIT)
+#define SENSE_DEBOUNCE_MS       5   // a sensor must be released this long before it clears
 
 #define SENSE_TIMER             TIMER2_BASE
 
@@ -115,7 +137,8 @@
 #define LIMIT_MASK              ((1<<X_LIMIT_BIT)|(1<<Y_LIMIT_BIT)|(1<<Z_LIMIT_BIT)|(1<<E_LIMIT_BIT))
 
 
-#define STEPPING_TIMER          TIMER1_BASE
+#define STEPPING_TIMER          WTIMER0_BASE   // 32 bit halves: A steps, B step pulse
+#define SEGMENT_PREP_INT        INT_TIMER5A    // unused timer interrupt, software triggered
 
 #define STEP_EN_PORT            GPIO_PORTB_BASE
 #define STEP_EN                 0
@@ -148,7 +171,6 @@
 
 
 
-#define STEP_HOME_TIMEOUT       (3000)  /* How long to wait whilst homing before we assume the limit switch(es) are broken */
 
 
 
@@ -167,15 +189,10 @@
 #define LASER_EN_MASK           (1 << LASER_EN_BIT)
 #define LASER_EN_INVERT         0
 
-// The temporal resolution of the acceleration management subsystem. Higher number give smoother
-// acceleration but may impact performance.
-// NOTE: Increasing this parameter will help any resolution related issues, especially with machines 
-// requiring very high accelerations and/or very fast feedrates. In general, this will reduce the 
-// error between how the planner plans the motions and how the stepper program actually performs them.
-// However, at some point, the resolution can be high enough, where the errors related to numerical 
-// round-off can be great enough to cause problems and/or it's too fast for the Arduino. The correct
-// value for this parameter is machine dependent, so it's advised to set this only as high as needed.
-// Approximate successful values can range from 30L to 100L or more.
+// The rate at which the segment prep re-evaluates the speed profile exactly and the real-time
+// overrides take effect. The stepper interrupt ramps the rate from step to step in between, so
+// this doesn't affect the smoothness of the acceleration. Higher values cost segment prep time
+// and need a deeper segment buffer to cover the same time.
 #define ACCELERATION_TICKS_PER_SECOND 400L
 
 // Minimum planner junction speed. Sets the default minimum speed the planner plans for at the end
@@ -0,0 +1,77 @@
+/*
+  fastio.h - inline register access for the stepper and laser ISRs
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// The driverlib calls are out of line and check their arguments, which adds up when they
+// run several times per step. These do the same register writes inline. Use the driverlib
+// for setup code, these only where it counts.
+
+#ifndef fastio_h
+#define fastio_h
+
+#ifdef HOST_BUILD
+// The host builds (host/) record the register writes instead.
+#include "host/fastio_mock.h"
+#else
+
+#include <stdint.h>
+#include <inc/hw_types.h>
+#include <inc/hw_gpio.h>
+#include <inc/hw_timer.h>
+#include <driverlib/timer.h>
+
+// Set the pins in mask to value. GPIODATA is bit-masked by address bits 9:2,
+// so only the pins in mask are written and no read-modify-write is needed.
+static inline void fastio_write(uint32_t port, uint8_t mask, uint8_t value) {
+  HWREG(port + GPIO_O_DATA + ((uint32_t)mask << 2)) = value;
+}
+
+// Read the pins in mask, the others read as 0.
+static inline uint8_t fastio_read(uint32_t port, uint8_t mask) {
+  return HWREG(port + GPIO_O_DATA + ((uint32_t)mask << 2));
+}
+
+// Set the interval load register of timer A or B.
+static inline void fastio_timer_load(uint32_t base, uint32_t timer, uint32_t value) {
+  HWREG(base + (timer == TIMER_A ? TIMER_O_TAILR : TIMER_O_TBILR)) = value;
+}
+
+// Read the counter of timer A or B.
+static inline uint32_t fastio_timer_value(uint32_t base, uint32_t timer) {
+  return HWREG(base + (timer == TIMER_A ? TIMER_O_TAV : TIMER_O_TBV));
+}
+
+// Acknowledge timer interrupts (TIMER_TIMA_TIMEOUT, ...).
+static inline void fastio_timer_int_clear(uint32_t base, uint32_t flags) {
+  HWREG(base + TIMER_O_ICR) = flags;
+}
+
+// Set the match register of timer A or B (the PWM duty cycle).
+static inline void fastio_timer_match(uint32_t base, uint32_t timer, uint32_t value) {
+  HWREG(base + (timer == TIMER_A ? TIMER_O_TAMATCHR : TIMER_O_TBMATCHR)) = value;
+}
+
+// Set the prescale match register of timer A or B, bits 23:16 of the match in PWM mode.
+static inline void fastio_timer_prescale_match(uint32_t base, uint32_t timer, uint32_t value) {
+  HWREG(base + (timer == TIMER_A ? TIMER_O_TAPMR : TIMER_O_TBPMR)) = value;
+}
+
+// Start timer A or B, for restarting one-shots from an ISR.
+static inline void fastio_timer_enable(uint32_t base, uint32_t timer) {
+  HWREG(base + TIMER_O_CTL) |= timer & (TIMER_CTL_TAEN | TIMER_CTL_TBEN);
+}
+
+#endif // HOST_BUILD
+
+#endif
@@ -33,6 +33,8 @@
 #include <inc/hw_gpio.h>
 
 #include <driverlib/gpio.h>
+#include <driverlib/sysctl.h>
+#include <driverlib/eeprom.h>
 
 #include "config.h"
 
@@ -44,6 +46,7 @@
 #include "stepper.h"
 #include "temperature.h"
 #include "tasks.h"
+#include "isr_timing.h"
 
 enum {
 	NEXT_ACTION_NONE = 0,
@@ -63,6 +66,10 @@ enum {
 	NEXT_ACTION_SET_ACCELERATION,
 	NEXT_ACTION_SET_PPI,
 	NEXT_ACTION_SET_PARAMETERS,
+	NEXT_ACTION_ESTIMATE_BEGIN,
+	NEXT_ACTION_ESTIMATE_END,
+	NEXT_ACTION_SET_PWM_FREQUENCY,
+	NEXT_ACTION_SET_STATUS_REPORT,
 };
 
 #define OFFSET_G54 0
@@ -70,6 +77,15 @@ enum {
 
 #define BUFFER_LINE_SIZE 80
 
+// The position saved on an orderly shutdown (M500), restored on the next boot instead of homing.
+#define POSITION_EEPROM_ADDRESS 0
+#define POSITION_EEPROM_MAGIC   0x4c475031  // "LGP1"
+
+typedef struct {
+	uint32_t magic;						// POSITION_EEPROM_MAGIC if valid
+	int32_t position[3];				// machine position in um
+} saved_position_t;
+
 static uint8_t raster_buffer[RASTER_BUFFER_SIZE];
 
 static char rx_line[BUFFER_LINE_SIZE] = {0};
@@ -80,6 +96,12 @@ static uint8_t line_checksum_ok_already;
 
 static uint8_t display_version = 1;
 
+static uint32_t line_count = 0;		// G-code lines executed, the sequence number of the status report
+static bool response_pending = false;	// the response of the line that started the homing cycle is due
+
+static char deferred_line[BUFFER_LINE_SIZE];	// the motion line that started a deferred homing cycle
+static bool eeprom_ok;
+
 #define FAIL(status) gc.status_code = status;
 
 typedef struct {
@@ -94,9 +116,11 @@ typedef struct {
 	uint8_t offselect;            		// currently active offset, 0 -> G54, 1 -> G55
 	uint8_t laser_pwm;					// 0-255 percentage
 	uint16_t laser_ppi;					// Laser PPI (Pulses Per Inch)
-	double acceleration;			   	// mm/min/min
+	double acceleration;			   	// mm/min/min, cuts {M204 S}
+	double seek_acceleration;			// mm/min/min, moves with the laser off {M204 T}
 	raster_t raster;					// Raster State
 	uint32_t pulse_duration;			// Duration of a laser pulse in us
+	bool homed;							// the position is known (homed, or restored at boot)
 } parser_state_t;
 static parser_state_t gc;
 
@@ -106,12 +130,16 @@ static volatile bool position_update_requested; // make sure to update to steppe
 static int next_statement(char *letter, double *double_ptr, char *line,
 		uint8_t *char_counter);
 static int read_double(char *line, uint8_t *char_counter, double *double_ptr);
+static GCODE_STATUS gcode_save_position(void);
+static void print_line_status(GCODE_STATUS status_code);
+static void print_status(bool print_extended_status);
 
 void gcode_init() {
 	memset(&gc, 0, sizeof(gc));
 	gc.feed_rate = CONFIG_DEFAULT_RATE;
 	gc.seek_rate = CONFIG_DEFAULT_RATE;
 	gc.acceleration = CONFIG_DEFAULT_ACCELERATION;
+	gc.seek_acceleration = CONFIG_SEEK_ACCELERATION;
 	gc.absolute_mode = true;
 	gc.laser_pwm = 0U;
 	gc.laser_ppi = 0U;
@@ -131,6 +159,9 @@ void gcode_init() {
 	line_checksum_ok_already = false;
 
 	gc.raster.buffer = raster_buffer;
+
+	SysCtlPeripheralEnable(SYSCTL_PERIPH_EEPROM0);
+	eeprom_ok = (EEPROMInit() == EEPROM_INIT_OK);
 }
 
 static double limit_feedrate_vector(double feedrate, uint16_t ppi) {
@@ -169,12 +200,13 @@ static float to_millimeters(float value)
 uint8_t gcode_process_data(const tUSBBuffer *psBuffer) {
 	uint8_t chr = '\0';
 
-	if (planner_blocks_available() < PLANNER_FIFO_READY_THRESHOLD) {
+	// wait for free blocks and for the homing cycle
+	if (planner_blocks_available() < PLANNER_FIFO_READY_THRESHOLD || task_running(TASK_HOMING)) {
 		return 1;
 	}
 
 	// Read all data available...
-	while ((planner_blocks_available() >= PLANNER_FIFO_READY_THRESHOLD) &&
+	while ((planner_blocks_available() >= PLANNER_FIFO_READY_THRESHOLD) && !task_running(TASK_HOMING) &&
 		   (USBBufferRead(psBuffer, &chr, 1) == 1) ) {
 		if ((chr == 0x0A) || (chr == 0x0D)) {
 			//// process line
@@ -183,6 +215,8 @@ uint8_t gcode_process_data(const tUSBBuffer *psBuffer) {
 				gcode_process_line(rx_line, rx_chars);
 				rx_chars = 0;
 			}
+		} else if (chr == CMD_HANDLED) {
+			// a real-time command, already done, keep it out of the line and its checksum
 		} else if (rx_chars + 1 >= BUFFER_LINE_SIZE) {
 			// reached line size, other side sent too long lines
 			stepper_request_stop(GCODE_STATUS_LINE_BUFFER_OVERFLOW);
@@ -205,7 +239,7 @@ uint8_t gcode_process_data(const tUSBBuffer *psBuffer) {
 		}
 	}
 
-	if (planner_blocks_available() < PLANNER_FIFO_READY_THRESHOLD) {
+	if (planner_blocks_available() < PLANNER_FIFO_READY_THRESHOLD || task_running(TASK_HOMING)) {
 		return 1;
 	}
 
@@ -231,6 +265,8 @@ void gcode_process_line(char *buffer, int length) {
 		// Tell the machine to stop.
 		stepper_request_stop(GCODE_STATUS_SERIAL_STOP_REQUEST);
 		stepper_synchronize();
+		// Abandon a dry run.
+		planner_estimate_end();
 
 		// Reset the raster buffer.
 		gc.raster.length = 0;
@@ -332,54 +368,75 @@ void gcode_process_line(char *buffer, int length) {
 		if (!skip_line) {
 			if (rx_line_cursor[0] != '?') {
 				// process the next line of G-code
+				planner_set_line_number(++line_count);
 				status_code = gcode_execute_line(rx_line_cursor);
-				switch (status_code) {
-				case GCODE_STATUS_OK:
-					break;
-
-				case GCODE_STATUS_BAD_NUMBER_FORMAT:
-					printString("N");  // Warning: Bad number format
-					break;
-
-				case GCODE_STATUS_EXPECTED_COMMAND_LETTER:
-					printString("E");  // Warning: Expected command letter
-					break;
-
-				case GCODE_STATUS_UNSUPPORTED_STATEMENT:
-					printString("U");  // Warning: Unsupported statement
-					break;
-
-				default:
-					printString("W");  // Warning: Other error
-					printInteger(status_code);
-					break;
+				if (task_running(TASK_HOMING)) {
+					// answer once the homing cycle and a line waiting for it are done
+					response_pending = true;
+					return;
 				}
+				print_line_status(status_code);
 			} else {
 				print_extended_status = true;
 			}
 		}
 	}
 
+	print_status(print_extended_status);
+}
+
+// The warning letter of a line's status code.
+static void print_line_status(GCODE_STATUS status_code) {
+	switch (status_code) {
+	case GCODE_STATUS_OK:
+		break;
+
+	case GCODE_STATUS_BAD_NUMBER_FORMAT:
+		printString("N");  // Warning: Bad number format
+		break;
+
+	case GCODE_STATUS_EXPECTED_COMMAND_LETTER:
+		printString("E");  // Warning: Expected command letter
+		break;
+
+	case GCODE_STATUS_UNSUPPORTED_STATEMENT:
+		printString("U");  // Warning: Unsupported statement
+		break;
+
+	default:
+		printString("W");  // Warning: Other error
+		printInteger(status_code);
+		break;
+	}
+}
+
+// The machine state that ends every response, and the line break.
+static void print_status(bool print_extended_status) {
+	if (!gc.homed) {
+		printString("H");  // Warning: Not homed (yet)
+	}
+
 #ifndef DEBUG_IGNORE_SENSORS
 	//// door and chiller status
-	if (SENSE_DOOR_OPEN) {
+	uint8_t sensors = sense_state;  // one consistent snapshot
+	if (sensors & SENSE_STATE_DOOR_OPEN) {
 		printString("D");  // Warning: Door is open
 	}
 	if (SENSE_CHILLER_OFF) {
 		printString("C");  // Warning: Chiller is off
 	}
 	// limit
-	if (SENSE_LIMITS) {
-		if (SENSE_X_LIMIT) {
+	if ((sense_ignore == 0) && (sensors & (SENSE_STATE_X_LIMIT | SENSE_STATE_Y_LIMIT))) {
+		if (sensors & SENSE_STATE_X_LIMIT) {
 			printString("L1");  // Limit X Hit
 		}
-		if (SENSE_Y_LIMIT) {
+		if (sensors & SENSE_STATE_Y_LIMIT) {
 			printString("L2");  // Limit Y Hit
 		}
-		if (SENSE_Z_LIMIT) {
+		if (sensors & SENSE_STATE_Z_LIMIT) {
 			printString("L3");  // Limit Z Hit
 		}
-		if (SENSE_E_LIMIT) {
+		if (sensors & SENSE_STATE_E_LIMIT) {
 			printString("L4");  // E Stop Hit
 		}
 	}
@@ -392,16 +449,59 @@ void gcode_process_line(char *buffer, int length) {
 			printString("# LasaurGrbl " LASAURGRBL_VERSION"\n");
 		}
 		// position
+		stepper_state_t state;
+		stepper_get_state(&state);
 		printString("X");
-		printFloat(stepper_get_position_x());
+		printFloat(state.position[X_AXIS] / x_steps_per_mm);
 		printString("Y");
-		printFloat(stepper_get_position_y());
+		printFloat(state.position[Y_AXIS] / y_steps_per_mm);
+		// transmit backpressure, output dropped and status lines replaced
+		uint32_t tx_dropped, tx_coalesced;
+		serial_tx_counters(&tx_dropped, &tx_coalesced);
+		if (tx_dropped || tx_coalesced) {
+			printString("Q");
+			printInteger(tx_dropped);
+			printString(",");
+			printInteger(tx_coalesced);
+		}
 		// version
 		printPgmString("V" LASAURGRBL_VERSION);
 	}
 	printString("\n");
 }
 
+// The periodic status report (M655), one line:
+// @ X:<mm> Y:<mm> Z:<mm> B:<queued blocks> N:<line> P:<laser 0-255> T:<deg C>,<deg C> S:<sensors>
+// N is the sequence number of the line being executed, counting the executed lines from 1.
+// The stepper ISR publishes it with the segment it starts, the prepared ones are ahead of it.
+// S is the sense_state word. Only the latest report waits for the host, older ones are dropped.
+void gcode_status_report(void) {
+	stepper_state_t state;
+	stepper_get_state(&state);
+
+	serial_line_class(SERIAL_TX_STATUS);
+	printString("@ X:");
+	printFloat(state.position[X_AXIS] / x_steps_per_mm);
+	printString(" Y:");
+	printFloat(state.position[Y_AXIS] / y_steps_per_mm);
+	printString(" Z:");
+	printFloat(state.position[Z_AXIS] / CONFIG_Z_STEPS_PER_MM);
+	printString(" B:");
+	printInteger(planner_blocks_queued());
+	printString(" N:");
+	// the line the steppers are on, once they are done the last line
+	printInteger(stepper_active() || planner_blocks_queued() > 0 ? state.line : line_count);
+	printString(" P:");
+	printInteger(control_get_intensity());
+	printString(" T:");
+	printFloat(temperature_read(0) / 16.0);
+	printString(",");
+	printFloat(temperature_read(1) / 16.0);
+	printString(" S:");
+	printInteger(sense_state);
+	printString("\n");
+}
+
 // Executes one line of 0-terminated G-Code. The line is assumed to contain only uppercase
 // characters and signed floating point values (no whitespace). Comments and block delete
 // characters have been removed.
@@ -415,12 +515,11 @@ uint8_t gcode_execute_line(char *line) {
 	double offset[3];
 	double vector[3] = {0.0};
 	int l = 0;
-	int d = 0;
-	int b = 0;
 	double n = -1.0;
 	double p = 0.0;
 	double r = 0.0;
 	double s = 0.0;
+	double t = 0.0;
 	int cs = 0;
 	bool got_actual_line_command = false;  // as opposed to just e.g. G1 F1200
 
@@ -547,21 +646,51 @@ uint8_t gcode_execute_line(char *line) {
 			case 107:
 				next_action = NEXT_ACTION_AIR_ASSIST_DISABLE;
 				break;
-			case 114:
+			case 114: {
+				stepper_state_t state;
+				stepper_get_state(&state);
 				printString("ok C: X:");
-				printFloat(stepper_get_position_x());
+				printFloat(state.position[X_AXIS] / x_steps_per_mm);
 				printString(" Y:");
-				printFloat(stepper_get_position_y());
+				printFloat(state.position[Y_AXIS] / y_steps_per_mm);
 				printString(" Z:");
-				printFloat(stepper_get_position_z());
+				printFloat(state.position[Z_AXIS] / CONFIG_Z_STEPS_PER_MM);
 				printString("\n");
 				break;
+			}
 			case 204:
 				next_action = NEXT_ACTION_SET_ACCELERATION;
 				break;
+			case 500: {
+				GCODE_STATUS status = gcode_save_position();
+				if (status != GCODE_STATUS_OK) {
+					FAIL(status);
+				}
+				break;
+			}
 			case 649:
 				next_action = NEXT_ACTION_SET_PARAMETERS;
 				break;
+			case 650:
+				next_action = NEXT_ACTION_ESTIMATE_BEGIN;
+				break;
+			case 651:
+				next_action = NEXT_ACTION_ESTIMATE_END;
+				break;
+			case 652:
+				next_action = NEXT_ACTION_SET_PWM_FREQUENCY;
+				break;
+			case 655:
+				next_action = NEXT_ACTION_SET_STATUS_REPORT;
+				break;
+#ifdef CONFIG_ISR_TIMING
+			case 653:
+				isr_timing_report();
+				break;
+			case 654:
+				isr_timing_clear();
+				break;
+#endif
 			default:
 				FAIL(GCODE_STATUS_UNSUPPORTED_STATEMENT);
 				break;
@@ -596,11 +725,11 @@ uint8_t gcode_execute_line(char *line) {
 				break;
 			case 'I': case 'J': case 'K': offset[letter-'I'] = to_millimeters(value); break;
 			case 'L': l = trunc(value); break;
-			case 'D': d = trunc(value); break;
-			case 'B': b = trunc(value); break;
+			case 'D': case 'B': break;  // accepted, not used
 			case 'N': n = value; break;
 			case 'P': p = value; break;
 			case 'R': r = to_millimeters(value); break;
+			case 'T': t = value; break;
 			case 'S':
 				s = value;
 				if (next_action == NEXT_ACTION_NONE) {
@@ -631,10 +760,28 @@ uint8_t gcode_execute_line(char *line) {
 		return (gc.status_code);
 	}
 
+	// Deferred homing (CONFIG_DEFER_HOMING): the first motion homes the machine,
+	// the line is executed when the homing cycle is done.
+	if (!gc.homed && got_actual_line_command && !planner_estimate_active()) {
+		switch (next_action) {
+		case NEXT_ACTION_SEEK:
+		case NEXT_ACTION_FEED:
+		case NEXT_ACTION_CW_ARC:
+		case NEXT_ACTION_CCW_ARC:
+		case NEXT_ACTION_RASTER:
+			strncpy(deferred_line, line, BUFFER_LINE_SIZE - 1);
+			gcode_do_home();
+			return gc.status_code;
+		default:
+			break;
+		}
+	}
+
 	//// Perform any physical actions
 	switch (next_action) {
-	case NEXT_ACTION_SET_ACCELERATION:
-		gc.acceleration = s * 3600;
+	case NEXT_ACTION_SET_ACCELERATION:  // mm/sec^2
+		if (s > 0) { gc.acceleration = s * 3600; }
+		if (t > 0) { gc.seek_acceleration = t * 3600; }
 		break;
 	case NEXT_ACTION_SET_PPI:
 		gc.laser_ppi = s;
@@ -644,7 +791,7 @@ uint8_t gcode_execute_line(char *line) {
 			planner_line(target[X_AXIS] + gc.offsets[3 * gc.offselect + X_AXIS],
 					target[Y_AXIS] + gc.offsets[3 * gc.offselect + Y_AXIS],
 					target[Z_AXIS] + gc.offsets[3 * gc.offselect + Z_AXIS],
-					gc.seek_rate, gc.acceleration, 0, 0);
+					gc.seek_rate, gc.seek_acceleration, 0, 0);
 		}
 		break;
 	case NEXT_ACTION_FEED:
@@ -792,7 +939,8 @@ uint8_t gcode_execute_line(char *line) {
 				planner_raster(target[X_AXIS] + gc.offsets[3 * gc.offselect + X_AXIS],
 						target[Y_AXIS] + gc.offsets[3 * gc.offselect + Y_AXIS],
 						target[Z_AXIS] + gc.offsets[3 * gc.offselect + Z_AXIS],
-						limit_feedrate_raster(gc.feed_rate, gc.laser_ppi), gc.acceleration, gc.laser_pwm, &gc.raster);
+						limit_feedrate_raster(gc.feed_rate, gc.laser_ppi), gc.acceleration, gc.seek_acceleration,
+						gc.laser_pwm, &gc.raster);
 			}
 
 			// Always increment (no point sending blank lines)
@@ -861,6 +1009,36 @@ uint8_t gcode_execute_line(char *line) {
 		gc.pulse_duration = l;
 		gc.laser_pwm = s;
 		break;
+	case NEXT_ACTION_ESTIMATE_BEGIN:
+		// Dry run: following moves are timed, not executed.
+		planner_estimate_begin();
+		break;
+	case NEXT_ACTION_ESTIMATE_END:
+		printString("ok E:");
+		printFloat(planner_estimate_end());
+		printString("\n");
+		// Back to where the machine really is.
+		gcode_request_position_update();
+		break;
+	case NEXT_ACTION_SET_PWM_FREQUENCY:
+		// Laser PWM frequency in Hz, e.g. M652 S20000
+		if (s < CONFIG_LASER_PWM_FREQ_MIN || s > CONFIG_LASER_PWM_FREQ_MAX) {
+			FAIL(GCODE_STATUS_BAD_NUMBER_FORMAT);
+		} else {
+			stepper_synchronize();  // not in the middle of a cut
+			control_laser_frequency(s);
+		}
+		break;
+	case NEXT_ACTION_SET_STATUS_REPORT:
+		// Push a status report every S ms, e.g. M655 S20 for 50Hz. S0 stops them.
+		if (s <= 0) {
+			task_disable(TASK_STATUS_REPORT);
+		} else if (s < CONFIG_STATUS_REPORT_MIN_MS) {
+			FAIL(GCODE_STATUS_BAD_NUMBER_FORMAT);
+		} else {
+			task_enable(TASK_STATUS_REPORT, (void*)(uintptr_t)s);
+		}
+		break;
 	}
 
 	// As far as the parser is concerned, the position is now == target. In reality the
@@ -887,7 +1065,7 @@ void gcode_manual_move(double x, double y, double z, double rate) {
 	planner_line(target[X_AXIS] + gc.offsets[3 * gc.offselect + X_AXIS],
 				 target[Y_AXIS] + gc.offsets[3 * gc.offselect + Y_AXIS],
 				 target[Z_AXIS] + gc.offsets[3 * gc.offselect + Z_AXIS],
-				 rate, 800000, 0, 0);
+				 rate, gc.seek_acceleration, 0, 0);
 
 	//target[X_AXIS] = max(target[X_AXIS] + gc.offsets[3 * gc.offselect + X_AXIS], CONFIG_X_MIN);
 	//target[X_AXIS] = min(target[X_AXIS] + gc.offsets[3 * gc.offselect + X_AXIS], CONFIG_X_MAX);
@@ -912,19 +1090,107 @@ void gcode_set_offset_to_current_position(void) {
 }
 
 // Utility function to home the machine
+// The homing cycle runs from the main loop, no commands are read until it is done.
 void gcode_do_home(void) {
-	stepper_homing_cycle();
-	// now that we are at the physical home
-	// zero all the position vectors
+	if (!planner_estimate_active()) {
+		stepper_homing_start();
+		task_enable(TASK_HOMING, 0);
+		return;
+	}
+	gcode_homing_done(true);
+}
+
+// Called when the homing cycle is done, homed is false if it failed.
+// Sends the response of the line that started the cycle, with the status of the motion
+// line that was waiting for it. A failed homing cycle at boot is reported on its own.
+void gcode_homing_done(bool homed) {
+	GCODE_STATUS status_code = GCODE_STATUS_OK;
+
+	// the steppers are at 0,0 now, homed or not
 	clear_vector(gc.position);
 	planner_set_position(0.0, 0.0, 0.0);
 
-	// move head to g54 offset
+	if (homed) {
+		// move head to g54 offset
+		gc.offselect = OFFSET_G54;
+		planner_line(gc.offsets[3 * gc.offselect + X_AXIS],
+				gc.offsets[3 * gc.offselect + Y_AXIS],
+				gc.offsets[3 * gc.offselect + Z_AXIS], gc.seek_rate,
+				gc.seek_acceleration, 0, 0);
+
+		if (!planner_estimate_active()) {
+			gc.homed = true;
+		}
+		// run the motion line that was waiting for homing
+		if (deferred_line[0] != '\0') {
+			char line[BUFFER_LINE_SIZE];
+			strcpy(line, deferred_line);
+			deferred_line[0] = '\0';
+			status_code = gcode_execute_line(line);
+		}
+	} else {
+		// the origin is unknown, don't run the job on it
+		gc.homed = false;
+		deferred_line[0] = '\0';
+		status_code = GCODE_STATUS_HOMING_FAILED;
+	}
+
+	if (response_pending || status_code != GCODE_STATUS_OK) {
+		response_pending = false;
+		print_line_status(status_code);
+		print_status(false);
+	}
+}
+
+// Restore the position saved on the last orderly shutdown, the machine is then ready without
+// homing. Otherwise it stays unhomed until the first motion command or G28.
+void gcode_restore_position(void) {
+	saved_position_t saved;
+	double position[3];
+	int i;
+
+	if (!eeprom_ok) {
+		return;
+	}
+	EEPROMRead((uint32_t *)&saved, POSITION_EEPROM_ADDRESS, sizeof(saved));
+	if (saved.magic != POSITION_EEPROM_MAGIC) {
+		return;
+	}
+	// The head may be moved by hand while the power is off, use the record only once.
+	saved.magic = 0;
+	EEPROMProgram(&saved.magic, POSITION_EEPROM_ADDRESS, sizeof(saved.magic));
+
+	for (i = X_AXIS; i <= Z_AXIS; i++) {
+		position[i] = saved.position[i] / 1000.0;
+		gc.position[i] = position[i] - gc.offsets[3 * OFFSET_G54 + i];
+	}
 	gc.offselect = OFFSET_G54;
-	planner_line(gc.offsets[3 * gc.offselect + X_AXIS],
-			gc.offsets[3 * gc.offselect + Y_AXIS],
-			gc.offsets[3 * gc.offselect + Z_AXIS], gc.seek_rate,
-			gc.acceleration, 0, 0);
+	stepper_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS]);
+	planner_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS]);
+	gc.homed = true;
+}
+
+// Save the position for the next boot (M500), send before switching the machine off.
+static GCODE_STATUS gcode_save_position(void) {
+	saved_position_t saved;
+	stepper_state_t state;
+
+	if (!gc.homed) {
+		return GCODE_STATUS_NOT_HOMED;  // the position means nothing
+	}
+	if (!eeprom_ok) {
+		return GCODE_STATUS_EEPROM_ERROR;
+	}
+	stepper_synchronize();
+	stepper_get_state(&state);
+	saved.magic = POSITION_EEPROM_MAGIC;
+	saved.position[X_AXIS] = lround(state.position[X_AXIS] / x_steps_per_mm * 1000.0);
+	saved.position[Y_AXIS] = lround(state.position[Y_AXIS] / y_steps_per_mm * 1000.0);
+	saved.position[Z_AXIS] = lround(state.position[Z_AXIS] / CONFIG_Z_STEPS_PER_MM * 1000.0);
+	if (EEPROMProgram((uint32_t *)&saved, POSITION_EEPROM_ADDRESS, sizeof(saved)) != 0) {
+		return GCODE_STATUS_EEPROM_ERROR;
+	}
+	return GCODE_STATUS_OK;
 }
 
 double* gcode_get_offsets (void) {
@@ -22,6 +22,7 @@
 #ifndef gcode_h
 #define gcode_h
 
+#include <stdbool.h>
 #include <inc/hw_types.h>
 #include <usblib/usblib.h>
 
@@ -39,6 +40,9 @@ typedef enum {
 	GCODE_STATUS_DOOR_OPEN,
 	GCODE_STATUS_CHILLER_OFF,
 	GCODE_STATUS_ARC_RADIUS_ERROR,
+	GCODE_STATUS_HOMING_FAILED,
+	GCODE_STATUS_NOT_HOMED,
+	GCODE_STATUS_EEPROM_ERROR,
 } GCODE_STATUS;
 
 // Initialize the parser
@@ -64,8 +68,16 @@ void gcode_manual_move(double x, double y, double z, double rate);
 // Set the offsets to the current location
 void gcode_set_offset_to_current_position(void);
 
+// Start the homing cycle, gcode_homing_done() is called when it's over
 void gcode_do_home(void);
+void gcode_homing_done(bool homed);
+
+// Restore the position saved by M500 at boot (CONFIG_DEFER_HOMING)
+void gcode_restore_position(void);
 
 double* gcode_get_offsets (void);
 
+// Print the periodic status report (M655)
+void gcode_status_report(void);
+
 #endif
@@ -0,0 +1,40 @@
+/*
+  check.h - the checks of the host tests
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// Included once by each test. A failed CHECK prints where and why and the test goes
+// on, check_result prints the verdict and is the exit status.
+
+#ifndef check_h
+#define check_h
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+      failures++; \
+      printf("%s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+    } \
+  } while (0)
+
+static int check_result(const char *test) {
+  printf("%s: %s\n", test, failures == 0 ? "ok" : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
+
+#endif
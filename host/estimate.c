@@ -0,0 +1,162 @@
+/*
+  estimate.c - the run time of a G-code job on the host
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// estimate [-x] [-t] [-v] [job.ngc]
+//
+// Reads a job (or stdin) and prints the time in seconds the dry run (M650/M651)
+// estimates for it. With -x the job is then run through the segment prep and the
+// stepper ISR, and the time the step timer counted is printed with the error of the
+// estimate. -t (with -x) also prints what the interrupts did: the step timer periods
+// (cycles at 80MHz), the pin and timer writes per run and the host time per run.
+// -v shows the serial responses on stderr.
+// Both start from the G54 origin of a homed machine, as a job on the machine does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <driverlib/sysctl.h>
+
+#include "config.h"
+#include "gcode.h"
+#include "planner.h"
+#include "stepper.h"
+#include "host.h"
+
+#define LINE_SIZE 80  // BUFFER_LINE_SIZE of gcode.c
+
+static char *job;
+static size_t job_length;
+
+static void read_job(FILE *in);
+static void run_job(bool execute);
+static void print_isr_stats(const char *name, const host_isr_stats_t *stats);
+
+
+int main(int argc, char *argv[]) {
+  bool execute = false;
+  bool timing = false;
+  FILE *in = stdin;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-x") == 0) {
+      execute = true;
+    } else if (strcmp(argv[i], "-t") == 0) {
+      timing = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      host_serial = stderr;
+    } else if (argv[i][0] == '-' || in != stdin) {
+      fprintf(stderr, "usage: %s [-x] [-t] [-v] [job.ngc]\n", argv[0]);
+      return 2;
+    } else if ((in = fopen(argv[i], "r")) == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+  }
+  read_job(in);
+
+  gcode_init();
+  planner_init();
+  stepper_init();
+
+  // home, that moves the head to the G54 origin
+  gcode_homing_done(true);
+  host_run_until_idle();
+
+  planner_estimate_begin();
+  run_job(false);
+  double estimate = planner_estimate_end();
+  gcode_request_position_update();
+
+  if (!execute) {
+    printf("%.3f\n", estimate);
+    return 0;
+  }
+
+  host_cycles_reset();
+  run_job(true);
+  host_run_until_idle();
+  double executed = (double)host_cycles() / SysCtlClockGet();
+
+  printf("estimate %.3f s\n", estimate);
+  printf("executed %.3f s\n", executed);
+  printf("error    %+.2f%%\n", executed > 0.0 ? (estimate - executed) / executed * 100.0 : 0.0);
+  if (timing) {
+    printf("stepper  period %u to %u cycles\n", host_stepper_stats.period_min,
+           host_stepper_stats.period_max);
+    print_isr_stats("stepper", &host_stepper_stats);
+    print_isr_stats("segment", &host_prep_stats);
+  }
+  return 0;
+}
+
+
+static void print_isr_stats(const char *name, const host_isr_stats_t *stats) {
+  uint32_t runs = (stats->runs > 0) ? stats->runs : 1;
+  printf("%-8s %u runs, %.1f writes (at most %u), %.0f ns on the host per run\n", name,
+         stats->runs, (double)stats->writes / runs, stats->writes_max, (double)stats->ns / runs);
+}
+
+
+static void read_job(FILE *in) {
+  size_t size = 1 << 16;
+  size_t n;
+
+  job = malloc(size);
+  while (job != NULL && (n = fread(job + job_length, 1, size - job_length, in)) > 0) {
+    job_length += n;
+    if (job_length == size) {
+      size *= 2;
+      job = realloc(job, size);
+    }
+  }
+  if (job == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+}
+
+// Feed the job line by line as gcode_process_data does: spaces and control characters
+// dropped, and a line taken only when the planner has PLANNER_FIFO_READY_THRESHOLD blocks
+// free. The step timer runs in between, when the job is executed.
+static void run_job(bool execute) {
+  char line[LINE_SIZE];
+  size_t length = 0;
+  size_t i;
+
+  for (i = 0; i <= job_length; i++) {
+    char chr = (i < job_length) ? job[i] : '\n';
+    if (chr == '\n' || chr == '\r') {
+      if (length > 0) {
+        line[length] = '\0';
+        while (execute && planner_blocks_available() < PLANNER_FIFO_READY_THRESHOLD) {
+          host_wait_for_interrupt();
+        }
+        gcode_process_line(line, length);
+        length = 0;
+      }
+    } else if ((unsigned char)chr <= 0x20) {
+      // ignore control characters and space
+    } else if (length + 1 >= LINE_SIZE) {
+      fprintf(stderr, "line too long (the machine stops with a line buffer overflow)\n");
+      exit(1);
+    } else {
+      line[length++] = chr;
+    }
+  }
+}
@@ -0,0 +1,57 @@
+/*
+  fastio_mock.c - the register table and write log behind fastio_mock.h
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "fastio.h"
+
+#define FASTIO_MOCK_REGS  64
+
+static struct {
+  uint32_t address;
+  uint32_t value;
+} regs[FASTIO_MOCK_REGS];
+static uint32_t reg_count;
+
+fastio_mock_write_t fastio_mock_log[FASTIO_MOCK_LOG_SIZE];
+uint32_t fastio_mock_log_count;
+
+
+volatile uint32_t *fastio_mock_reg(uint32_t address) {
+  uint32_t i;
+  for (i = 0; i < reg_count; i++) {
+    if (regs[i].address == address) { return &regs[i].value; }
+  }
+  if (reg_count == FASTIO_MOCK_REGS) {
+    fprintf(stderr, "fastio_mock: more than %d registers\n", FASTIO_MOCK_REGS);
+    exit(2);
+  }
+  regs[reg_count].address = address;
+  regs[reg_count].value = 0;
+  return &regs[reg_count++].value;
+}
+
+void fastio_mock_write(uint32_t address, uint32_t value) {
+  if (fastio_mock_log_count < FASTIO_MOCK_LOG_SIZE) {
+    fastio_mock_log[fastio_mock_log_count].address = address;
+    fastio_mock_log[fastio_mock_log_count].value = value;
+  }
+  fastio_mock_log_count++;
+  *fastio_mock_reg(address) = value;
+}
+
+void fastio_mock_reset(void) {
+  fastio_mock_log_count = 0;
+}
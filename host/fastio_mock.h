@@ -0,0 +1,89 @@
+/*
+  fastio_mock.h - host replacement of fastio.h, records the register writes
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// Included by fastio.h in the host builds (HOST_BUILD). The fastio functions keep their
+// signatures, but the registers live in a small table and every write is appended to
+// fastio_mock_log, so a test can replay what the ISRs did to the pins and timers.
+// HWREG is redirected to the same table for the few direct register accesses.
+
+#ifndef fastio_mock_h
+#define fastio_mock_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <inc/hw_types.h>
+#include <inc/hw_gpio.h>
+#include <inc/hw_timer.h>
+#include <driverlib/timer.h>
+
+#define FASTIO_MOCK_LOG_SIZE  65536
+
+typedef struct {
+  uint32_t address;  // the register, for GPIODATA including the mask bits 9:2
+  uint32_t value;
+} fastio_mock_write_t;
+
+extern fastio_mock_write_t fastio_mock_log[FASTIO_MOCK_LOG_SIZE];
+extern uint32_t fastio_mock_log_count;  // the writes since the reset, may exceed the log size
+
+// The register at address, created (as 0) on first use.
+volatile uint32_t *fastio_mock_reg(uint32_t address);
+// Append a write to the log and store it.
+void fastio_mock_write(uint32_t address, uint32_t value);
+// Clear the log, the registers keep their values.
+void fastio_mock_reset(void);
+
+#undef HWREG
+#define HWREG(x) (*fastio_mock_reg(x))
+
+// The state of all pins of a port, GPIODATA with all mask bits set.
+#define FASTIO_MOCK_PINS(port)  ((port) + GPIO_O_DATA + (0xFF << 2))
+
+static inline void fastio_write(uint32_t port, uint8_t mask, uint8_t value) {
+  volatile uint32_t *pins = fastio_mock_reg(FASTIO_MOCK_PINS(port));
+  fastio_mock_write(port + GPIO_O_DATA + ((uint32_t)mask << 2), value);
+  *pins = (*pins & ~mask) | (value & mask);
+}
+
+static inline uint8_t fastio_read(uint32_t port, uint8_t mask) {
+  return *fastio_mock_reg(FASTIO_MOCK_PINS(port)) & mask;
+}
+
+static inline void fastio_timer_load(uint32_t base, uint32_t timer, uint32_t value) {
+  fastio_mock_write(base + (timer == TIMER_A ? TIMER_O_TAILR : TIMER_O_TBILR), value);
+}
+
+static inline uint32_t fastio_timer_value(uint32_t base, uint32_t timer) {
+  return *fastio_mock_reg(base + (timer == TIMER_A ? TIMER_O_TAV : TIMER_O_TBV));
+}
+
+static inline void fastio_timer_int_clear(uint32_t base, uint32_t flags) {
+  fastio_mock_write(base + TIMER_O_ICR, flags);
+}
+
+static inline void fastio_timer_match(uint32_t base, uint32_t timer, uint32_t value) {
+  fastio_mock_write(base + (timer == TIMER_A ? TIMER_O_TAMATCHR : TIMER_O_TBMATCHR), value);
+}
+
+static inline void fastio_timer_prescale_match(uint32_t base, uint32_t timer, uint32_t value) {
+  fastio_mock_write(base + (timer == TIMER_A ? TIMER_O_TAPMR : TIMER_O_TBPMR), value);
+}
+
+static inline void fastio_timer_enable(uint32_t base, uint32_t timer) {
+  uint32_t ctl = *fastio_mock_reg(base + TIMER_O_CTL);
+  fastio_mock_write(base + TIMER_O_CTL, ctl | (timer & (TIMER_CTL_TAEN | TIMER_CTL_TBEN)));
+}
+
+#endif
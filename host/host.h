@@ -0,0 +1,65 @@
+/*
+  host.h - the simulated machine behind the host builds
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// The firmware sources are built unchanged against stubs.c. The stubs keep the handlers
+// the firmware registers and run them the way the NVIC would: a pended interrupt runs
+// right away from the main loop, or when the interrupt it was pended from returns.
+// The step timer has no clock, it runs when the main loop waits (STEPPER_WAIT) or
+// when a test calls host_wait_for_interrupt, and counts the cycles it stood for.
+
+#ifndef host_h
+#define host_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Run the step timer interrupt once, if the timer is enabled.
+void host_wait_for_interrupt(void);
+// Run the step timer until the stepper goes idle.
+void host_run_until_idle(void);
+
+// Is the step timer running?
+bool host_step_timer_enabled(void);
+// The cycles of the step timer periods run so far.
+uint64_t host_cycles(void);
+void host_cycles_reset(void);
+
+// The laser pulses fired (control_laser with a pulse length, PPI), each as the
+// fastio_mock_log_count at the time, to place it among the step writes. A test clears
+// host_pulse_count, it may exceed the log size.
+#define HOST_PULSE_LOG_SIZE  4096
+extern uint32_t host_pulse_log[HOST_PULSE_LOG_SIZE];
+extern uint32_t host_pulse_count;
+
+// Where the serial output goes, NULL drops it.
+extern FILE *host_serial;
+
+// What an interrupt handler did since host_cycles_reset: its runs, the host time they
+// took (ns, mostly comparable between builds), the pin and timer writes (fastio_mock),
+// and for the step timer the shortest and longest period it ran (cycles).
+typedef struct {
+  uint32_t runs;
+  uint64_t ns;
+  uint64_t writes;
+  uint32_t writes_max;
+  uint32_t period_min;
+  uint32_t period_max;
+} host_isr_stats_t;
+
+extern host_isr_stats_t host_stepper_stats;   // the step timer interrupt
+extern host_isr_stats_t host_prep_stats;      // the segment prep
+
+#endif
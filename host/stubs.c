@@ -0,0 +1,314 @@
+/*
+  stubs.c - the driverlib, peripherals and serial port of the host builds
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#define _POSIX_C_SOURCE 199309L  // clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <inc/hw_memmap.h>
+#include <inc/hw_ints.h>
+
+#include <driverlib/gpio.h>
+#include <driverlib/interrupt.h>
+#include <driverlib/sysctl.h>
+#include <driverlib/timer.h>
+#include <driverlib/eeprom.h>
+#include <driverlib/udma.h>
+#include <usblib/usblib.h>
+#include <usblib/usb-ids.h>
+#include <usblib/usbcdc.h>
+#include <usblib/device/usbdevice.h>
+#include <usblib/device/usbdcdc.h>
+
+#include "config.h"
+#include "fastio.h"
+#include "serial.h"
+#include "tasks.h"
+#include "sense_control.h"
+#include "temperature.h"
+#include "host.h"
+
+#define HOST_CLOCK  80000000
+
+FILE *host_serial = NULL;
+
+// Interrupts
+static void (*int_handler[NUM_INTERRUPTS])(void);
+static bool int_enabled[NUM_INTERRUPTS];
+static bool int_pending[NUM_INTERRUPTS];
+static uint8_t int_priority[NUM_INTERRUPTS];
+static uint32_t int_active;   // nesting of the interrupts running
+
+// Step timer (timer A of STEPPING_TIMER)
+static void (*step_timer_handler)(void);
+static bool step_timer_enabled;
+static uint64_t cycles;
+
+// Interrupt statistics
+host_isr_stats_t host_stepper_stats;
+host_isr_stats_t host_prep_stats;
+
+// Laser
+uint32_t host_pulse_log[HOST_PULSE_LOG_SIZE];
+uint32_t host_pulse_count;
+
+// Tasks
+static uint32_t tasks_enabled;
+uint32_t system_time_ms = 0;
+
+// Sensors
+uint8_t sense_ignore = 0;
+volatile uint8_t sense_state = 0;
+
+
+static uint64_t host_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Run a handler and add it to stats.
+static void run_handler(void (*handler)(void), host_isr_stats_t *stats) {
+  uint32_t writes = fastio_mock_log_count;
+  uint64_t start = host_ns();
+  handler();
+  stats->ns += host_ns() - start;
+  writes = fastio_mock_log_count - writes;
+  stats->writes += writes;
+  stats->writes_max = (writes > stats->writes_max) ? writes : stats->writes_max;
+  stats->runs++;
+}
+
+// Run the pended interrupts, highest priority (lowest number) first. Nothing
+// preempts an interrupt on the host, so they wait until the running one returns.
+static void int_dispatch(void) {
+  uint32_t i, next;
+  if (int_active > 0) { return; }
+  while (true) {
+    next = NUM_INTERRUPTS;
+    for (i = 0; i < NUM_INTERRUPTS; i++) {
+      if (int_pending[i] && int_enabled[i] && int_handler[i] != NULL
+          && (next == NUM_INTERRUPTS || int_priority[i] < int_priority[next])) {
+        next = i;
+      }
+    }
+    if (next == NUM_INTERRUPTS) { return; }
+    int_pending[next] = false;
+    int_active++;
+    if (next == SEGMENT_PREP_INT) {
+      run_handler(int_handler[next], &host_prep_stats);
+    } else {
+      int_handler[next]();
+    }
+    int_active--;
+  }
+}
+
+void host_wait_for_interrupt(void) {
+  if (!step_timer_enabled || int_active > 0) { return; }
+  // the period loaded last ends now
+  uint32_t period = *fastio_mock_reg(STEPPING_TIMER + TIMER_O_TAILR);
+  cycles += period;
+  if (host_stepper_stats.runs == 0 || period < host_stepper_stats.period_min) {
+    host_stepper_stats.period_min = period;
+  }
+  if (period > host_stepper_stats.period_max) {
+    host_stepper_stats.period_max = period;
+  }
+  int_active++;
+  run_handler(step_timer_handler, &host_stepper_stats);
+  int_active--;
+  int_dispatch();
+}
+
+void host_run_until_idle(void) {
+  while (step_timer_enabled) {
+    host_wait_for_interrupt();
+  }
+}
+
+bool host_step_timer_enabled(void) {
+  return step_timer_enabled;
+}
+
+uint64_t host_cycles(void) {
+  return cycles;
+}
+
+void host_cycles_reset(void) {
+  cycles = 0;
+  memset(&host_stepper_stats, 0, sizeof(host_stepper_stats));
+  memset(&host_prep_stats, 0, sizeof(host_prep_stats));
+}
+
+
+//// driverlib
+
+void IntRegister(uint32_t ui32Interrupt, void (*pfnHandler)(void)) {
+  int_handler[ui32Interrupt] = pfnHandler;
+}
+
+void IntEnable(uint32_t ui32Interrupt) {
+  int_enabled[ui32Interrupt] = true;
+  int_dispatch();
+}
+
+void IntDisable(uint32_t ui32Interrupt) {
+  int_enabled[ui32Interrupt] = false;
+}
+
+void IntPendSet(uint32_t ui32Interrupt) {
+  int_pending[ui32Interrupt] = true;
+  int_dispatch();
+}
+
+void IntPrioritySet(uint32_t ui32Interrupt, uint8_t ui8Priority) {
+  int_priority[ui32Interrupt] = ui8Priority;
+}
+
+void TimerIntRegister(uint32_t ui32Base, uint32_t ui32Timer, void (*pfnHandler)(void)) {
+  if (ui32Base == STEPPING_TIMER && ui32Timer == TIMER_A) {
+    step_timer_handler = pfnHandler;
+  }
+}
+
+void TimerEnable(uint32_t ui32Base, uint32_t ui32Timer) {
+  if (ui32Base == STEPPING_TIMER && (ui32Timer & TIMER_A)) {
+    step_timer_enabled = true;
+  }
+}
+
+void TimerDisable(uint32_t ui32Base, uint32_t ui32Timer) {
+  if (ui32Base == STEPPING_TIMER && (ui32Timer & TIMER_A)) {
+    step_timer_enabled = false;
+  }
+}
+
+void TimerConfigure(uint32_t ui32Base, uint32_t ui32Config) {}
+void TimerIntEnable(uint32_t ui32Base, uint32_t ui32IntFlags) {}
+
+uint32_t SysCtlClockGet(void) {
+  return HOST_CLOCK;
+}
+
+void SysCtlPeripheralEnable(uint32_t ui32Peripheral) {}
+
+void GPIOPinWrite(uint32_t ui32Port, uint8_t ui8Pins, uint8_t ui8Val) {
+  fastio_write(ui32Port, ui8Pins, ui8Val);
+}
+
+int32_t GPIOPinRead(uint32_t ui32Port, uint8_t ui8Pins) {
+  return fastio_read(ui32Port, ui8Pins);
+}
+
+void GPIOPinTypeGPIOInput(uint32_t ui32Port, uint8_t ui8Pins) {}
+void GPIOPinTypeGPIOOutput(uint32_t ui32Port, uint8_t ui8Pins) {}
+void GPIOPadConfigSet(uint32_t ui32Port, uint8_t ui8Pins, uint32_t ui32Strength, uint32_t ui32PadType) {}
+
+// An erased EEPROM, there is no saved position.
+uint32_t EEPROMInit(void) {
+  return EEPROM_INIT_OK;
+}
+
+void EEPROMRead(uint32_t *pui32Data, uint32_t ui32Address, uint32_t ui32Count) {
+  memset(pui32Data, 0xFF, ui32Count);
+}
+
+uint32_t EEPROMProgram(uint32_t *pui32Data, uint32_t ui32Address, uint32_t ui32Count) {
+  return 0;
+}
+
+void uDMAEnable(void) {}
+void uDMAControlBaseSet(void *pControlTable) {}
+void uDMAChannelAssign(uint32_t ui32Mapping) {}
+void uDMAChannelAttributeDisable(uint32_t ui32ChannelNum, uint32_t ui32Attr) {}
+void uDMAChannelControlSet(uint32_t ui32ChannelStructIndex, uint32_t ui32Control) {}
+void uDMAChannelTransferSet(uint32_t ui32ChannelStructIndex, uint32_t ui32Mode,
+                            void *pvSrcAddr, void *pvDstAddr, uint32_t ui32TransferSize) {}
+
+uint32_t USBBufferRead(const tUSBBuffer *psBuffer, uint8_t *pui8Data, uint32_t ui32Length) {
+  return 0;
+}
+
+
+//// peripherals
+
+void control_laser(uint8_t on_off, uint32_t pulse_length) {
+  if (on_off && pulse_length > 0) {
+    if (host_pulse_count < HOST_PULSE_LOG_SIZE) {
+      host_pulse_log[host_pulse_count] = fastio_mock_log_count;
+    }
+    host_pulse_count++;
+  }
+}
+// the intensity itself, in the match register of the PWM
+void control_laser_intensity(uint8_t intensity) {
+  fastio_timer_match(LASER_TIMER, TIMER_A, intensity);
+}
+void control_laser_frequency(uint32_t frequency) {}
+uint8_t control_get_intensity(void) { return 0; }
+void control_air_assist(bool enable) {}
+void control_aux1_assist(bool enable) {}
+
+uint8_t sense_read(void) {
+  return 0;
+}
+
+uint16_t temperature_read(uint8_t sensor) {
+  return 0;
+}
+
+void task_enable(TASK task, void* data) {
+  tasks_enabled |= 1 << task;
+}
+
+void task_disable(TASK task) {
+  tasks_enabled &= ~(1 << task);
+}
+
+uint8_t task_running(TASK task) {
+  return (tasks_enabled & (1 << task)) != 0;
+}
+
+
+//// serial
+
+void serial_line_class(uint8_t tx_class) {}
+
+void serial_tx_counters(uint32_t *dropped, uint32_t *coalesced) {
+  *dropped = 0;
+  *coalesced = 0;
+}
+
+void printString(const char *s) {
+  if (host_serial != NULL) { fputs(s, host_serial); }
+}
+
+void printPgmString(const char *s) {
+  printString(s);
+}
+
+void printInteger(long n) {
+  if (host_serial != NULL) { fprintf(host_serial, "%ld", n); }
+}
+
+void printFloat(double n) {
+  if (host_serial != NULL) { fprintf(host_serial, "%.3f", n); }
+}
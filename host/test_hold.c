@@ -0,0 +1,257 @@
+/*
+  test_hold.c - feed hold, stop, resume and feed overrides in the middle of a move
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// Runs the stepper an interrupt at a time, opens the door (a feed hold), changes the feed
+// override or requests a stop along the way, and follows the speed and the position:
+// - the step event rate (the step_cycles the ISR publishes per segment) changes between
+//   segments no more than the acceleration allows over the events in between, from
+//   standstill, to standstill in a hold, again when resumed, and to the overridden
+//   rate. Only a stop is abrupt.
+// - the steps sent to the pins add up to the position the stepper reports, the head
+//   stands still once held, and the move ends on its target after the resume. After a
+//   stop, the next move starts from where the head stopped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <inc/hw_memmap.h>
+
+#include "config.h"
+#include "fastio.h"
+#include "gcode.h"
+#include "planner.h"
+#include "stepper.h"
+#include "sense_control.h"
+#include "host.h"
+#include "check.h"
+
+#define STEP_DATA     (STEP_PORT + GPIO_O_DATA + (STEP_MASK << 2))
+#define STEP_DIR_DATA (STEP_DIR_PORT + GPIO_O_DATA + (STEP_DIR_MASK << 2))
+#define CLOCK         80000000.0
+#define FEED_RATE     6000.0
+// step events per second^2 along an axis
+#define ACCELERATION  (CONFIG_DEFAULT_ACCELERATION / 3600.0 * CONFIG_X_STEPS_PER_MM)
+#define MIN_RATE      (MINIMUM_STEPS_PER_MINUTE / 60.0)
+
+static uint32_t published;          // step_cycles as the stepper reports it
+static uint32_t segment_cycles;     // step_cycles of the segment running, 0 at standstill
+static uint32_t segment_events;     // the step events it ran so far
+static uint64_t last_step;          // host_cycles of the last step
+static int32_t position[2];         // as the stepper reports it
+static int32_t pins[2];             // the steps sent to the pins
+static uint8_t dir_pins;
+static uint32_t seen;               // the fastio_mock_log writes counted
+static bool stopping;               // a stop was requested, it may be abrupt
+
+
+// The rate change from segment_cycles to cycles (0: standstill) over segment_events.
+static void check_rate(uint32_t cycles, const char *what) {
+  double from = (segment_cycles == 0) ? 0.0 : CLOCK / segment_cycles;
+  double to = (cycles == 0) ? 0.0 : CLOCK / cycles;
+  // v^2 changes by 2*a per step event, the ramps start and end half an event off
+  // standstill (rate^2 = a), the slowest rate is MIN_RATE
+  double limit = 2 * ACCELERATION * (segment_events + 0.5) * 1.1 + MIN_RATE * MIN_RATE;
+  CHECK(fabs(to * to - from * from) <= limit,
+        "%s: %.0f to %.0f steps/s over %u step events, at most %.0f", what, from, to,
+        segment_events, sqrt(from * from + limit));
+}
+
+// Count the steps fastio_mock logged since the last call.
+static void count_pins(void) {
+  for (; seen < fastio_mock_log_count && seen < FASTIO_MOCK_LOG_SIZE; seen++) {
+    fastio_mock_write_t *w = &fastio_mock_log[seen];
+    if (w->address == STEP_DIR_DATA) {
+      dir_pins = w->value ^ STEP_DIR_INVERT;
+    } else if (w->address == STEP_DATA) {
+      if (w->value & (1 << STEP_X_BIT)) { pins[X_AXIS] += ((dir_pins >> STEP_X_DIR) & 1) ? -1 : 1; }
+      if (w->value & (1 << STEP_Y_BIT)) { pins[Y_AXIS] += ((dir_pins >> STEP_Y_DIR) & 1) ? -1 : 1; }
+    }
+  }
+  if (fastio_mock_log_count > FASTIO_MOCK_LOG_SIZE / 2) {
+    fastio_mock_reset();
+    seen = 0;
+  }
+}
+
+// Run one stepper interrupt and follow the rate.
+static void tick(void) {
+  stepper_state_t state;
+  uint32_t events;
+
+  host_wait_for_interrupt();
+  count_pins();
+  stepper_get_state(&state);
+  events = max(labs(state.position[X_AXIS] - position[X_AXIS]),
+               labs(state.position[Y_AXIS] - position[Y_AXIS]));
+  position[X_AXIS] = state.position[X_AXIS];
+  position[Y_AXIS] = state.position[Y_AXIS];
+
+  if (state.step_cycles != published || (segment_cycles == 0 && events > 0)) {
+    // a new segment (its first interrupt stepped already), idle, or resumed
+    if (!stopping) {
+      check_rate(state.step_cycles, (segment_cycles == 0) ? "start" : "segment");
+    }
+    published = state.step_cycles;
+    segment_cycles = state.step_cycles;
+    segment_events = 0;
+  } else if (segment_cycles != 0 && events == 0
+             && host_cycles() - last_step > 4 * (uint64_t)segment_cycles) {
+    // the segments ran out and no step came since, held
+    check_rate(0, "hold");
+    segment_cycles = 0;
+    segment_events = 0;
+  }
+  segment_events += events;
+  if (events > 0) { last_step = host_cycles(); }
+}
+
+// Run until the head stood still for a while (held, or idle).
+static void run_until_still(void) {
+  while (host_step_timer_enabled()
+         && (segment_cycles != 0 || host_cycles() - last_step < CLOCK / 10)) {
+    tick();
+  }
+}
+
+static void run_until_idle(void) {
+  while (host_step_timer_enabled()) { tick(); }
+  CHECK(segment_cycles == 0, "idle at %u cycles per step event", segment_cycles);
+}
+
+// Run until the head made steps along the move.
+static void run_steps(int32_t steps) {
+  int32_t start_x = position[X_AXIS], start_y = position[Y_AXIS];
+  while (host_step_timer_enabled()
+         && max(labs(position[X_AXIS] - start_x), labs(position[Y_AXIS] - start_y)) < steps) {
+    tick();
+  }
+}
+
+// The reported position is where the pins took the head.
+static void check_position(const char *when) {
+  CHECK(pins[X_AXIS] == position[X_AXIS] && pins[Y_AXIS] == position[Y_AXIS],
+        "%s: at %d,%d, the pins made %d,%d", when, position[X_AXIS], position[Y_AXIS],
+        pins[X_AXIS], pins[Y_AXIS]);
+}
+
+// The head ended on x,y (mm).
+static void check_target(double x, double y) {
+  CHECK(position[X_AXIS] == lround(x * CONFIG_X_STEPS_PER_MM)
+        && position[Y_AXIS] == lround(y * CONFIG_Y_STEPS_PER_MM),
+        "at %d,%d, expected %ld,%ld", position[X_AXIS], position[Y_AXIS],
+        lround(x * CONFIG_X_STEPS_PER_MM), lround(y * CONFIG_Y_STEPS_PER_MM));
+  check_position("at the end");
+}
+
+// Open the door after steps along the move to x,y, and close it once the head stands.
+static void check_hold(double x, double y, int32_t steps) {
+  planner_line(x, y, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  run_steps(steps);
+  sense_state |= SENSE_STATE_DOOR_OPEN;
+  run_until_still();
+  if (!host_step_timer_enabled()) {
+    // held within the deceleration, the move ends on its target all the same
+    sense_state &= ~SENSE_STATE_DOOR_OPEN;
+    check_target(x, y);
+    return;
+  }
+  check_position("held");
+
+  // stands still while the door is open
+  int32_t held_x = position[X_AXIS], held_y = position[Y_AXIS];
+  uint32_t i;
+  for (i = 0; i < 1000; i++) { tick(); }
+  CHECK(position[X_AXIS] == held_x && position[Y_AXIS] == held_y, "moved while held");
+
+  sense_state &= ~SENSE_STATE_DOOR_OPEN;
+  run_until_idle();
+  check_target(x, y);
+}
+
+// Change the feed override after steps along the move to x,y and replan the queue, as
+// the main loop does (or not at all, the segment prep scales the blocks it takes).
+static void check_override(double x, double y, int32_t steps, uint8_t percent, bool replan) {
+  planner_line(x, y, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  run_steps(steps);
+  planner_set_feed_override(percent);
+  if (replan) { planner_apply_overrides(); }
+  run_until_idle();
+  check_target(x, y);
+}
+
+int main(void) {
+  gcode_init();
+  planner_init();
+  stepper_init();
+
+  // start inside the table
+  planner_line(100.0, 100.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  run_until_idle();
+  check_target(100.0, 100.0);
+
+  // held at full speed, accelerating and decelerating
+  check_hold(120.0, 100.0, 1500);
+  check_hold(100.0, 100.0, 100);
+  check_hold(100.0, 120.0, 2900);
+
+  // held on the first of two blocks, resumed over the corner
+  planner_line(110.0, 120.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  check_hold(110.0, 110.0, 1200);
+
+  // the door opened and closed again before the head stopped
+  planner_line(90.0, 110.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  run_steps(1000);
+  sense_state |= SENSE_STATE_DOOR_OPEN;
+  tick();
+  sense_state &= ~SENSE_STATE_DOOR_OPEN;
+  run_until_idle();
+  check_target(90.0, 110.0);
+
+  // overridden at full speed, accelerating, decelerating, and before a corner
+  check_override(120.0, 110.0, 1500, 50, true);
+  check_override(100.0, 110.0, 1500, 150, true);
+  check_override(120.0, 110.0, 200, 70, true);
+  check_override(100.0, 110.0, 2900, 100, true);
+  planner_line(100.0, 90.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  check_override(120.0, 90.0, 2000, 40, true);
+  planner_line(120.0, 110.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  check_override(100.0, 110.0, 1500, 160, false);
+  planner_set_feed_override(OVERRIDE_DEFAULT);
+  planner_line(120.0, 90.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  check_override(100.0, 90.0, 1000, 25, false);
+  planner_set_feed_override(OVERRIDE_DEFAULT);
+  planner_apply_overrides();
+
+  // a stop drops the move where it is
+  planner_line(120.0, 110.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  run_steps(1500);
+  stopping = true;
+  stepper_request_stop(GCODE_STATUS_LIMIT_HIT);
+  run_until_idle();
+  stopping = false;
+  check_position("stopped");
+  CHECK(position[Y_AXIS] < lround(110.0 * CONFIG_Y_STEPS_PER_MM), "the stop came after the move");
+  stepper_stop_resume();
+
+  // and the next one starts from there
+  planner_line(100.0, 105.0, 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  run_until_idle();
+  check_target(100.0, 105.0);
+
+  return check_result("test_hold");
+}
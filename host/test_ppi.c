@@ -0,0 +1,145 @@
+/*
+  test_ppi.c - where the PPI laser pulses land along a move
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// Queues a few PPI cuts, runs them, and places each pulse the stepper fired among the
+// step writes. The k-th pulse belongs to the first step event whose travel along the
+// path reaches k mm per pulse (prep_ppi_run), also across the blocks of a cut, the
+// travel since the last pulse carries over. It fires on the first interrupt of that
+// step event, with AMASS that may be before the step itself: within a step either way.
+// A feed override changed in the middle of a cut changes the speed, not where the pulses land.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <inc/hw_memmap.h>
+
+#include "config.h"
+#include "fastio.h"
+#include "gcode.h"
+#include "planner.h"
+#include "stepper.h"
+#include "host.h"
+#include "check.h"
+
+#define STEP_DATA     (STEP_PORT + GPIO_O_DATA + (STEP_MASK << 2))
+#define MAX_LINES     4
+
+typedef struct {
+  double x, y;  // mm, relative
+} line_t;
+
+
+// Cut the lines one after another at ppi pulses per inch and check the pulses. The feed
+// override changes to override percent after the first interrupts of the cut.
+static void check_cut(const line_t *lines, int line_count, uint16_t ppi, double feed_rate,
+                      uint8_t override) {
+  double mm_per_pulse = MM_PER_INCH / ppi;
+  uint32_t events[MAX_LINES];     // step events of each line
+  double step_mm[MAX_LINES];      // path travel of a step event
+  uint8_t major_bit[MAX_LINES];   // the axis stepping with every event
+  double length = 0.0;
+
+  // a move first, the travel of the last cut doesn't carry over it
+  planner_line(stepper_get_position_x() + 1.0, stepper_get_position_y(), 0.0, 1500.0,
+               CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  host_run_until_idle();
+
+  int32_t x_steps = lround(stepper_get_position_x() * CONFIG_X_STEPS_PER_MM);
+  int32_t y_steps = lround(stepper_get_position_y() * CONFIG_Y_STEPS_PER_MM);
+  double x = stepper_get_position_x();
+  double y = stepper_get_position_y();
+  int i;
+
+  fastio_mock_reset();
+  host_pulse_count = 0;
+  for (i = 0; i < line_count; i++) {
+    x += lines[i].x;
+    y += lines[i].y;
+    // the steps as the planner rounds them
+    int32_t dx = labs(lround(x * CONFIG_X_STEPS_PER_MM) - x_steps);
+    int32_t dy = labs(lround(y * CONFIG_Y_STEPS_PER_MM) - y_steps);
+    x_steps = lround(x * CONFIG_X_STEPS_PER_MM);
+    y_steps = lround(y * CONFIG_Y_STEPS_PER_MM);
+    events[i] = max(dx, dy);
+    major_bit[i] = (dx >= dy) ? (1 << STEP_X_BIT) : (1 << STEP_Y_BIT);
+    step_mm[i] = hypot(dx / CONFIG_X_STEPS_PER_MM, dy / CONFIG_Y_STEPS_PER_MM) / events[i];
+    length += events[i] * step_mm[i];
+    planner_line(x, y, 0.0, feed_rate, CONFIG_DEFAULT_ACCELERATION, 255, ppi);
+  }
+  if (override != OVERRIDE_DEFAULT) {
+    for (i = 0; i < 300 && host_step_timer_enabled(); i++) { host_wait_for_interrupt(); }
+    planner_set_feed_override(override);
+    planner_apply_overrides();
+  }
+  host_run_until_idle();
+  planner_set_feed_override(OVERRIDE_DEFAULT);
+  planner_apply_overrides();
+  CHECK(fastio_mock_log_count <= FASTIO_MOCK_LOG_SIZE, "log overflow");
+  CHECK(host_pulse_count <= HOST_PULSE_LOG_SIZE, "pulse log overflow");
+
+  // replay, the travel of the step events so far against the pulses
+  uint32_t pulse = 0;
+  uint32_t event = 0;   // step events of the current line
+  double travel = 0.0;  // of the lines before
+  int line = 0;
+  uint32_t n;
+  for (n = 0; n < fastio_mock_log_count && pulse < host_pulse_count; n++) {
+    while (pulse < host_pulse_count && host_pulse_log[pulse] == n) {
+      double at = travel + event * step_mm[line];
+      double expected = (pulse + 1) * mm_per_pulse;
+      CHECK(fabs(at - expected) < step_mm[line] + 1e-6,
+            "pulse %u at %.4f mm, expected %.4f mm (a step is %.4f mm)", pulse + 1, at, expected, step_mm[line]);
+      pulse++;
+    }
+    if (fastio_mock_log[n].address == STEP_DATA && fastio_mock_log[n].value != 0) {
+      if (event == events[line] && line + 1 < line_count) {
+        travel += events[line] * step_mm[line];
+        event = 0;
+        line++;
+      }
+      if (fastio_mock_log[n].value & major_bit[line]) { event++; }
+    }
+  }
+  CHECK(host_pulse_count == (uint32_t)floor(length / mm_per_pulse + 1e-6),
+        "%u pulses over %.4f mm, expected %u", host_pulse_count, length,
+        (uint32_t)floor(length / mm_per_pulse + 1e-6));
+}
+
+int main(void) {
+  gcode_init();
+  planner_init();
+  stepper_init();
+
+  // start inside the table
+  planner_line(10.0, 10.0, 0.0, 600.0, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  host_run_until_idle();
+
+  const line_t x_line[] = {{3.05, 0.0}};
+  check_cut(x_line, 1, 254, 1500.0, OVERRIDE_DEFAULT);  // a pulse every 0.1mm, 15.7 steps
+  const line_t diagonal[] = {{-1.83, 2.44}};
+  check_cut(diagonal, 1, 254, 1500.0, OVERRIDE_DEFAULT);
+  const line_t corner[] = {{1.53, 0.0}, {0.0, -1.53}, {-1.2, 0.9}};
+  check_cut(corner, 3, 300, 3000.0, OVERRIDE_DEFAULT);  // the travel carries over the junctions
+  const line_t dense[] = {{0.0, 2.0}, {1.0, 1.0}};
+  check_cut(dense, 2, 2540, 1500.0, OVERRIDE_DEFAULT);  // 0.01mm, close to one pulse per step event
+  // overridden while cutting, slower and faster
+  check_cut(corner, 3, 300, 3000.0, 30);
+  check_cut(diagonal, 1, 254, 1500.0, 200);
+
+  return check_result("test_ppi");
+}
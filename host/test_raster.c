@@ -0,0 +1,125 @@
+/*
+  test_raster.c - which raster dot the stepper shows at which step
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// Queues raster lines, forwards and back (bidirectional), runs them and replays the
+// x steps against the laser intensity set last (the stubs write it to the PWM match
+// register). Step event n of a line of length dots over N step events shows dot
+// (n-1)*length/N (raster_dot_start). Every step of the line must come with the
+// intensity of its dot, down to the last one, and the run-ups either side are off.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <inc/hw_memmap.h>
+
+#include "config.h"
+#include "fastio.h"
+#include "gcode.h"
+#include "planner.h"
+#include "stepper.h"
+#include "host.h"
+#include "check.h"
+
+#define STEP_DATA       (STEP_PORT + GPIO_O_DATA + (STEP_MASK << 2))
+#define STEP_DIR_DATA   (STEP_DIR_PORT + GPIO_O_DATA + (STEP_DIR_MASK << 2))
+#define LASER_MATCH     (LASER_TIMER + TIMER_O_TAMATCHR)
+#define FEED_RATE       3000.0
+#define INTENSITY       200
+
+
+// Raster the dots ('1' on) from x at feed_rate and check the intensity of every x step.
+// The dots start and end on, planner_raster trims the blank ends.
+static void check_line(const char *dots, double x, double dot_size, bool backwards) {
+  uint8_t buffer[RASTER_BUFFER_SIZE];
+  raster_t raster;
+  uint32_t length = strlen(dots);
+  double offset = FEED_RATE / 60.0 / 1000000.0 / 2.0;  // bidirectional 1us
+  int32_t start, end;  // the steps of the raster line
+  int32_t x_steps = lround(stepper_get_position_x() * CONFIG_X_STEPS_PER_MM);
+  uint8_t intensity = 0;
+  uint8_t pins = 0;
+  int32_t shown = 0;
+  uint32_t i;
+
+  if (backwards) {
+    start = lround((x + length * dot_size + offset) * CONFIG_X_STEPS_PER_MM);
+    end = lround((x + offset) * CONFIG_X_STEPS_PER_MM);
+  } else {
+    start = lround((x - offset) * CONFIG_X_STEPS_PER_MM);
+    end = lround((x + length * dot_size - offset) * CONFIG_X_STEPS_PER_MM);
+  }
+
+  memcpy(buffer, dots, length);
+  raster.buffer = buffer;
+  raster.length = length;
+  raster.invert = 0;
+  raster.bidirectional = 1.0;
+  raster.dot_size = dot_size;
+  fastio_mock_reset();
+  planner_raster(x, stepper_get_position_y(), 0.0, FEED_RATE, CONFIG_DEFAULT_ACCELERATION,
+                 CONFIG_DEFAULT_ACCELERATION, INTENSITY, &raster);
+  host_run_until_idle();
+  CHECK(fastio_mock_log_count <= FASTIO_MOCK_LOG_SIZE, "log overflow");
+
+  uint32_t events = labs(end - start);
+  for (i = 0; i < fastio_mock_log_count; i++) {
+    fastio_mock_write_t *w = &fastio_mock_log[i];
+    if (w->address == STEP_DIR_DATA) {
+      pins = w->value;
+    } else if (w->address == LASER_MATCH) {
+      intensity = w->value;
+    } else if (w->address == STEP_DATA && (w->value & (1 << STEP_X_BIT))) {
+      bool negative = ((pins ^ STEP_DIR_INVERT) >> STEP_X_DIR) & 1;
+      x_steps += negative ? -1 : 1;
+      // the step event of the line this step makes, 1 to events
+      int32_t n = backwards ? start - x_steps : x_steps - start;
+      if (n >= 1 && n <= (int32_t)events && negative == backwards) {
+        uint32_t dot = (uint64_t)(n - 1) * length / events;
+        char expected = dots[backwards ? length - 1 - dot : dot];
+        CHECK((intensity > 0) == (expected == '1'),
+              "%s step %d of %u: intensity %u on dot %u ('%c')",
+              backwards ? "backwards" : "forwards", n, events, intensity, dot, expected);
+        shown = n;
+      } else {
+        CHECK(intensity == 0, "step at %d: intensity %u outside the line (%d to %d)",
+              x_steps, intensity, start, end);
+      }
+    }
+  }
+  CHECK(shown == (int32_t)events, "the line ended on step %d of %u", shown, events);
+  CHECK(intensity == 0, "the laser is left at %u", intensity);
+}
+
+int main(void) {
+  gcode_init();
+  planner_init();
+  stepper_init();
+
+  // start inside the table
+  planner_line(10.0, 10.0, 0.0, 600.0, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  host_run_until_idle();
+
+  // bidirectional, every other line goes back
+  check_line("1101110001011", 12.0, 0.1, false);                  // 15.748 steps per dot
+  check_line("1000000000000000000000000000001", 12.0, 0.1, true);  // one dot at each end
+  check_line("1010101010101010101", 12.013, 0.0254, false);        // 1000 dpi, 4 steps a dot
+  check_line("10110011100011110000111110000011", 12.0, 0.05, true);
+
+  return check_result("test_raster");
+}
@@ -0,0 +1,176 @@
+/*
+  test_serial.c - the number formatting and the transmit buffering of serial.c
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// Links serial.c itself, on a USB buffer that keeps what it is given. printFloat must
+// print what printf's %.3f does (rounded half up rather than to even), and a line must
+// reach the USB buffer in one write, however it was printed. The bytes per write and
+// the host time per byte are printed, to compare builds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include <inc/hw_memmap.h>
+#include <driverlib/gpio.h>
+#include <usblib/usblib.h>
+#include <usblib/usbcdc.h>
+#include <usblib/device/usbdevice.h>
+#include <usblib/device/usbdcdc.h>
+
+#include "config.h"
+#include "serial.h"
+#include "tasks.h"
+#include "check.h"
+
+
+//// what serial.c links against
+
+const tUSBBuffer g_sTxBuffer;
+const tUSBBuffer g_sRxBuffer;
+tUSBDCDCDevice g_sCDCDevice;
+
+volatile uint8_t feed_override = 100;
+volatile uint8_t power_override = 100;
+
+static char usb_out[4096];     // what reached the USB buffer
+static uint32_t usb_length;
+static uint32_t usb_writes;
+
+uint32_t USBBufferWrite(const tUSBBuffer *psBuffer, const uint8_t *pui8Data, uint32_t ui32Length) {
+  if (usb_length + ui32Length >= sizeof(usb_out)) {
+    usb_length = 0;  // only the end matters
+  }
+  memcpy(usb_out + usb_length, pui8Data, ui32Length);
+  usb_length += ui32Length;
+  usb_out[usb_length] = '\0';
+  usb_writes++;
+  return ui32Length;
+}
+
+uint32_t USBBufferSpaceAvailable(const tUSBBuffer *psBuffer) {
+  return sizeof(usb_out) / 2;
+}
+
+void USBBufferInfoGet(const tUSBBuffer *psBuffer, tUSBRingBufObject *psRingBuf) {
+  memset(psRingBuf, 0, sizeof(*psRingBuf));
+}
+
+const tUSBBuffer *USBBufferInit(const tUSBBuffer *psBuffer) { return psBuffer; }
+void USBBufferFlush(const tUSBBuffer *psBuffer) {}
+void USBStackModeSet(uint32_t ui32Index, tUSBMode iUSBMode, tUSBModeCallback pfnCallback) {}
+void *USBDCDCInit(uint32_t ui32Index, tUSBDCDCDevice *psCDCDevice) { return psCDCDevice; }
+void GPIOPinTypeUSBAnalog(uint32_t ui32Port, uint8_t ui8Pins) {}
+void GPIOPinWrite(uint32_t ui32Port, uint8_t ui8Pins, uint8_t ui8Val) {}
+void IntPrioritySet(uint32_t ui32Interrupt, uint8_t ui8Priority) {}
+void planner_set_feed_override(uint8_t percent) {}
+void planner_set_power_override(uint8_t percent) {}
+void task_enable(TASK task, void *data) {}
+
+uint32_t ControlHandler(void *pvCBData, uint32_t ui32Event, uint32_t ui32MsgValue, void *pvMsgData);
+
+
+static void usb_reset(void) {
+  usb_length = 0;
+  usb_out[0] = '\0';
+  usb_writes = 0;
+}
+
+// What printFloat sends for n.
+static const char *print_float(double n) {
+  usb_reset();
+  printFloat(n);
+  serial_flush();
+  return usb_out;
+}
+
+// printFloat against printf, where a tie isn't at stake: n*1000 isn't exactly x.5.
+static void check_float(double n) {
+  char expected[32];
+  double scaled = fabs(n) * 1000.0;
+  if (scaled - floor(scaled) == 0.5) { return; }
+  snprintf(expected, sizeof(expected), "%.3f", n);
+  if (n == 0.0) { strcpy(expected, "0.000"); }  // no sign on -0
+  CHECK(strcmp(print_float(n), expected) == 0, "printFloat(%.17g) is %s, expected %s",
+        n, usb_out, expected);
+}
+
+int main(void) {
+  int32_t i;
+
+  serial_init();
+  ControlHandler(NULL, USB_EVENT_CONNECTED, 0, NULL);
+
+  //// format
+  check_float(0.0);
+  check_float(-0.0);
+  check_float(1.0);
+  check_float(-1.0);
+  check_float(0.0004999);
+  check_float(0.0005001);
+  check_float(-0.0004);
+  check_float(0.9995001);
+  check_float(325.0);
+  check_float(1e-300);
+  check_float(123456789.123);
+  check_float(4294967295.0);
+  for (i = -400000; i <= 400000; i += 7) {
+    check_float(i / 1000.0);           // positions, every micrometer
+    check_float(i / 1000.0 + 0.0004);  // rounded down
+    check_float(i / 1000.0 + 0.0006);  // rounded up
+    check_float(i / 3.0);
+  }
+  // exact ties round up (printf rounds them to even)
+  CHECK(strcmp(print_float(0.0625), "0.063") == 0, "0.0625 is %s", usb_out);
+  CHECK(strcmp(print_float(-2.5625), "-2.563") == 0, "-2.5625 is %s", usb_out);
+  // out of range saturates
+  CHECK(strcmp(print_float(1e10), "4294967295.999") == 0, "1e10 is %s", usb_out);
+  CHECK(strcmp(print_float(INFINITY), "4294967295.999") == 0, "inf is %s", usb_out);
+
+  //// a status line, as gcode_status_report prints it, goes out in one write
+  usb_reset();
+  printString("X");
+  printFloat(123.456);
+  printString("Y");
+  printFloat(-78.9);
+  printString("V");
+  printInteger(42);
+  printString("\n");
+  CHECK(strcmp(usb_out, "X123.456Y-78.900V42\n") == 0, "the line is %s", usb_out);
+  CHECK(usb_writes == 1, "the line took %u writes", usb_writes);
+
+  //// throughput
+  uint32_t bytes = 0;
+  uint32_t writes = 0;
+  clock_t start = clock();
+  for (i = 0; i < 200000; i++) {
+    usb_reset();
+    printString("X");
+    printFloat(i / 1000.0);
+    printString("Y");
+    printFloat(-i / 3000.0);
+    printString("\n");
+    bytes += usb_length;
+    writes += usb_writes;
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  printf("test_serial: %.1f bytes per USB write, %.1f ns per byte on the host\n",
+         (double)bytes / writes, seconds * 1e9 / bytes);
+
+  return check_result("test_serial");
+}
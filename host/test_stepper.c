@@ -0,0 +1,185 @@
+/*
+  test_stepper.c - the step and direction pins the stepper ISR writes for a short move
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// Queues a line, runs the segment prep and the stepper ISR until the stepper is idle,
+// then replays the register writes fastio_mock recorded: every step pulse must be sent
+// with the direction pins of the move and ended, and the steps of every interrupt must
+// be those of the bresenham line. With AMASS an event takes 2^level interrupts, the
+// major axis steps on the middle one (the counters start at -count/2), which gives the
+// level of each event. The minor axis is then traced interrupt by interrupt.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <inc/hw_memmap.h>
+
+#include "config.h"
+#include "fastio.h"
+#include "gcode.h"
+#include "planner.h"
+#include "stepper.h"
+#include "host.h"
+#include "check.h"
+
+#define STEP_DATA     (STEP_PORT + GPIO_O_DATA + (STEP_MASK << 2))
+#define STEP_DIR_DATA (STEP_DIR_PORT + GPIO_O_DATA + (STEP_DIR_MASK << 2))
+#define STEP_ICR      (STEPPING_TIMER + TIMER_O_ICR)
+#define MAX_TICKS     16384
+
+// as stepper.c
+#ifdef CONFIG_STEPPER_AMASS
+#define MAX_AMASS_LEVEL  3
+#else
+#define MAX_AMASS_LEVEL  0
+#endif
+
+// The interrupt of an event at an AMASS level the major axis steps on, 1 to 2^level.
+static uint32_t major_tick(uint8_t level) {
+  return (level == 0) ? 1 : (1 << (level - 1)) + 1;
+}
+
+// The level whose major axis steps on the tick, if any.
+static int level_of_major_tick(uint32_t tick) {
+  uint8_t level;
+  for (level = 0; level <= MAX_AMASS_LEVEL; level++) {
+    if (major_tick(level) == tick) { return level; }
+  }
+  return -1;
+}
+
+
+// Move by x_steps, y_steps at feed_rate and check the pins. Returns the AMASS levels
+// the events ran at, a bit each.
+static uint8_t check_move(int32_t x_steps, int32_t y_steps, double feed_rate) {
+  static uint8_t ticks[MAX_TICKS];  // the step bits each interrupt computed
+  double x = stepper_get_position_x() + x_steps / CONFIG_X_STEPS_PER_MM;
+  double y = stepper_get_position_y() + y_steps / CONFIG_Y_STEPS_PER_MM;
+  uint8_t dir_bits = ((x_steps < 0) << STEP_X_DIR) | ((y_steps < 0) << STEP_Y_DIR);
+  uint8_t dir_pins = dir_bits ^ STEP_DIR_INVERT;
+  bool x_major = labs(x_steps) >= labs(y_steps);
+  uint8_t major_bit = x_major ? (1 << STEP_X_BIT) : (1 << STEP_Y_BIT);
+  uint8_t minor_bit = x_major ? (1 << STEP_Y_BIT) : (1 << STEP_X_BIT);
+  int32_t major = max(labs(x_steps), labs(y_steps));
+  int32_t minor = min(labs(x_steps), labs(y_steps));
+  int32_t x_count = 0, y_count = 0;
+  uint32_t tick_count = 0;
+  uint8_t pins = 0;
+  uint8_t levels = 0;
+  bool pulse_open = false;
+  uint32_t i;
+
+  fastio_mock_reset();
+  planner_line(x, y, 0.0, feed_rate, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  host_run_until_idle();
+  CHECK(fastio_mock_log_count <= FASTIO_MOCK_LOG_SIZE, "log overflow");
+
+  for (i = 0; i < fastio_mock_log_count; i++) {
+    fastio_mock_write_t *w = &fastio_mock_log[i];
+    if (w->address == STEP_ICR && (w->value & TIMER_TIMA_TIMEOUT)) {
+      // an interrupt, it sends the steps the one before computed
+      if (tick_count < MAX_TICKS) { ticks[tick_count] = 0; }
+      tick_count++;
+    } else if (w->address == STEP_DIR_DATA) {
+      pins = w->value;
+    } else if (w->address == STEP_DATA && w->value != 0) {
+      CHECK(!pulse_open, "step %d: the last pulse was not ended", x_count);
+      CHECK((pins & STEP_DIR_MASK) == dir_pins, "step %d: direction pins 0x%02x, expected 0x%02x",
+            x_count, pins, dir_pins);
+      CHECK((w->value & ~STEP_MASK) == 0, "step %d: writes pins 0x%02x", x_count, w->value);
+      if (w->value & (1 << STEP_X_BIT)) { x_count++; }
+      if (w->value & (1 << STEP_Y_BIT)) { y_count++; }
+      if (tick_count >= 2 && tick_count - 2 < MAX_TICKS) { ticks[tick_count - 2] |= w->value; }
+      pulse_open = true;
+    } else if (w->address == STEP_DATA) {
+      pulse_open = false;  // the end of the ISR ends it
+    } else if (w->address == STEPPING_TIMER + TIMER_O_CTL && (w->value & TIMER_CTL_TBEN)) {
+      pulse_open = false;  // or the pulse timer (CONFIG_STEPPER_USE_PULSE_TIMER)
+    }
+  }
+  CHECK(!pulse_open, "the last pulse was not ended");
+  CHECK(x_count == labs(x_steps), "%d x steps, expected %d", x_count, (int32_t)labs(x_steps));
+  CHECK(y_count == labs(y_steps), "%d y steps, expected %d", y_count, (int32_t)labs(y_steps));
+  CHECK(fabs(stepper_get_position_x() - x) < 0.5 / CONFIG_X_STEPS_PER_MM
+        && fabs(stepper_get_position_y() - y) < 0.5 / CONFIG_Y_STEPS_PER_MM,
+        "at %f,%f, expected %f,%f", stepper_get_position_x(), stepper_get_position_y(), x, y);
+  CHECK(tick_count <= MAX_TICKS, "%u interrupts, trace too long", tick_count);
+  tick_count = min(tick_count, MAX_TICKS);
+
+  // the bresenham line, scaled by 2^MAX_AMASS_LEVEL as st_block_buffer holds it
+  int64_t count = (int64_t)major << MAX_AMASS_LEVEL;
+  int64_t counter = -(count >> 1);
+  uint32_t tick = 0;     // first interrupt of the event
+  uint32_t last_major;   // interrupt of the event the major axis steps on
+  int32_t event;
+  int level;
+
+  for (last_major = 0; last_major < tick_count && !(ticks[last_major] & major_bit); last_major++);
+  level = level_of_major_tick(last_major + 1);
+  for (event = 1; event <= major; event++) {
+    uint32_t j;
+    CHECK(level >= 0, "event %d: the major step comes on interrupt %u of it", event, last_major + 1 - tick);
+    if (level < 0) { return levels; }
+    levels |= 1 << level;
+    for (j = 1; j <= (1u << level); j++, tick++) {
+      uint8_t expected = (j == major_tick(level)) ? major_bit : 0;
+      counter += ((int64_t)minor << MAX_AMASS_LEVEL) >> level;
+      if (counter > 0) {
+        expected |= minor_bit;
+        counter -= count;
+      }
+      CHECK(tick < tick_count && ticks[tick] == expected,
+            "event %d (level %d), interrupt %u: steps 0x%02x, expected 0x%02x",
+            event, level, j, tick < tick_count ? ticks[tick] : 0, expected);
+      if (tick >= tick_count || ticks[tick] != expected) { return levels; }
+    }
+    // the next major step gives the level of the next event
+    if (event < major) {
+      uint32_t next = tick;
+      while (next < tick_count && !(ticks[next] & major_bit)) { next++; }
+      level = level_of_major_tick(next + 1 - tick);
+      last_major = next;
+    }
+  }
+  for (; tick < tick_count; tick++) {
+    CHECK(ticks[tick] == 0, "interrupt %u: steps 0x%02x after the line", tick, ticks[tick]);
+  }
+  return levels;
+}
+
+int main(void) {
+  gcode_init();
+  planner_init();
+  stepper_init();
+
+  // the planner clamps to the table (CONFIG_X_MIN, ...), start from the inside
+  check_move(300, 200, 600.0);
+  check_move(10, -4, 600.0);
+  check_move(-10, 4, 600.0);
+  check_move(-37, -11, 600.0);
+  // up to speed and back down, through the AMASS levels
+  planner_line(100.0, 100.0, 0.0, 6000.0, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+  host_run_until_idle();
+  uint8_t levels = check_move(-2000, 700, 6000.0);
+  levels |= check_move(300, -1501, 3000.0);
+  levels |= check_move(1999, 1998, 6000.0);
+#ifdef CONFIG_STEPPER_AMASS
+  CHECK(levels == 0x0F, "the moves ran at the AMASS levels 0x%02x, expected all four", levels);
+#endif
+
+  return check_result("test_stepper");
+}
@@ -0,0 +1,149 @@
+/*
+  isr_timing.c - worst case interrupt timing monitor
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#include "isr_timing.h"
+
+#ifdef CONFIG_ISR_TIMING
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <inc/hw_nvic.h>
+#include <driverlib/sysctl.h>
+#include <driverlib/interrupt.h>
+
+#include "serial.h"
+
+#define DWT_O_CTRL              0x00000000
+#define DWT_CTRL_CYCCNTENA      0x00000001
+#define NVIC_DBG_INT_TRCENA     0x01000000  // DEMCR, enables the DWT
+
+typedef struct {
+	uint32_t count;
+	uint32_t max;                             // cycles
+	uint32_t overruns;                        // runs over budget
+	uint32_t histogram[ISR_TIMING_BUCKETS];
+} isr_timing_t;
+
+static const char *isr_names[ISR_TIMING_END] = {
+	"stepper", "segment", "laser", "sense", "temperature", "joystick", "gptimer", "usb"
+};
+
+// Budget of each handler (us). The deadline of the stepper ISR is the step period,
+// its late entries show when it was missed.
+static const uint32_t isr_budget_us[ISR_TIMING_END] = {
+	5, 100, 2, 5, 10, 20, 5, 50
+};
+
+static isr_timing_t isr_timing[ISR_TIMING_END];
+static uint32_t isr_budget[ISR_TIMING_END];   // cycles
+
+static uint32_t step_late;          // stepper ISR entries later than CONFIG_ISR_TIMING_LATE_US
+static uint32_t step_latency_max;   // cycles
+static uint32_t step_late_cycles;
+
+
+void isr_timing_init(void) {
+	uint32_t cycles_per_microsecond = SysCtlClockGet() / 1000000;
+	uint8_t i;
+
+	for (i = 0; i < ISR_TIMING_END; i++) {
+		isr_budget[i] = isr_budget_us[i] * cycles_per_microsecond;
+	}
+	step_late_cycles = CONFIG_ISR_TIMING_LATE_US * cycles_per_microsecond;
+	isr_timing_clear();
+
+	HWREG(NVIC_DBG_INT) |= NVIC_DBG_INT_TRCENA;
+	HWREG(DWT_BASE + DWT_O_CYCCNT) = 0;
+	HWREG(DWT_BASE + DWT_O_CTRL) |= DWT_CTRL_CYCCNTENA;
+}
+
+void isr_timing_record(uint8_t isr, uint32_t cycles) {
+	isr_timing_t *t = &isr_timing[isr];
+	uint32_t bucket = cycles >> ISR_TIMING_BUCKET_SHIFT;
+
+	// the position of the highest set bit, 0 for the first bucket
+	bucket = (bucket == 0) ? 0 : 32 - __builtin_clz(bucket);
+	if (bucket >= ISR_TIMING_BUCKETS) {
+		bucket = ISR_TIMING_BUCKETS - 1;
+	}
+
+	// each handler writes only its own entry, a preempting one can't interfere
+	t->count++;
+	t->histogram[bucket]++;
+	if (cycles > t->max) {
+		t->max = cycles;
+	}
+	if (cycles > isr_budget[isr]) {
+		t->overruns++;
+	}
+}
+
+void isr_timing_step_latency(uint32_t cycles) {
+	if (cycles > step_latency_max) {
+		step_latency_max = cycles;
+	}
+	if (cycles > step_late_cycles) {
+		step_late++;
+	}
+}
+
+void isr_timing_report(void) {
+	isr_timing_t t;
+	uint32_t late, latency_max;
+	uint8_t i, b;
+
+	for (i = 0; i < ISR_TIMING_END; i++) {
+		// take a consistent copy, printing is slow
+		IntMasterDisable();
+		t = isr_timing[i];
+		late = step_late;
+		latency_max = step_latency_max;
+		IntMasterEnable();
+
+		printString("ok I:");
+		printString(isr_names[i]);
+		printString(" N:");
+		printInteger(t.count);
+		printString(" M:");
+		printInteger(t.max);
+		printString(" O:");
+		printInteger(t.overruns);
+		printString(" H:");
+		for (b = 0; b < ISR_TIMING_BUCKETS; b++) {
+			if (b > 0) {
+				printString(",");
+			}
+			printInteger(t.histogram[b]);
+		}
+		if (i == ISR_TIMING_STEPPER) {
+			printString(" L:");
+			printInteger(late);
+			printString(" W:");
+			printInteger(latency_max);
+		}
+		printString("\n");
+	}
+}
+
+void isr_timing_clear(void) {
+	IntMasterDisable();
+	memset(isr_timing, 0, sizeof(isr_timing));
+	step_late = 0;
+	step_latency_max = 0;
+	IntMasterEnable();
+}
+
+#endif
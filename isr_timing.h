@@ -0,0 +1,79 @@
+/*
+  isr_timing.h - worst case interrupt timing monitor
+  Part of LasaurGrbl
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// With CONFIG_ISR_TIMING the interrupt handlers are registered through a wrapper that stamps
+// entry and exit with the DWT cycle counter. Per handler it keeps the count, the longest run,
+// a histogram and the runs over budget. The stepper ISR also records how late it entered
+// relative to its programmed period. M653 reports, M654 clears.
+// The times include the handlers of higher priority that preempted the measured one.
+// Without CONFIG_ISR_TIMING the handlers are registered directly and nothing is compiled in.
+
+#ifndef isr_timing_h
+#define isr_timing_h
+
+#include <stdint.h>
+#include <inc/hw_types.h>
+#include <inc/hw_memmap.h>
+#include "config.h"
+
+enum {
+	ISR_TIMING_STEPPER = 0,
+	ISR_TIMING_SEGMENT_PREP,
+	ISR_TIMING_LASER,
+	ISR_TIMING_SENSE,
+	ISR_TIMING_TEMPERATURE,
+	ISR_TIMING_JOYSTICK,
+	ISR_TIMING_GP_TIMER,
+	ISR_TIMING_USB,
+	ISR_TIMING_END
+};
+
+#define ISR_TIMING_BUCKETS      8   // bucket 0 is below 128 cycles (1.6us), each next one doubles
+#define ISR_TIMING_BUCKET_SHIFT 7
+
+#ifdef CONFIG_ISR_TIMING
+
+#define DWT_O_CYCCNT            0x00000004
+
+void isr_timing_init(void);
+void isr_timing_record(uint8_t isr, uint32_t cycles);
+void isr_timing_report(void);
+void isr_timing_clear(void);
+
+// Interrupt latency of the stepper ISR, the cycles the step timer ran past its timeout.
+void isr_timing_step_latency(uint32_t cycles);
+
+static inline uint32_t isr_timing_cycles(void) {
+	return HWREG(DWT_BASE + DWT_O_CYCCNT);
+}
+
+// Define <handler>_timed, which runs handler between two stamps. Place it after the
+// handler's declaration, register ISR_TIMING_HANDLER(handler).
+#define ISR_TIMING_WRAPPER(handler, isr) \
+	static void handler##_timed(void) { \
+		uint32_t isr_timing_start = isr_timing_cycles(); \
+		handler(); \
+		isr_timing_record(isr, isr_timing_cycles() - isr_timing_start); \
+	}
+#define ISR_TIMING_HANDLER(handler) handler##_timed
+
+#else
+
+#define ISR_TIMING_WRAPPER(handler, isr)
+#define ISR_TIMING_HANDLER(handler) handler
+
+#endif
+
+#endif
@@ -33,6 +33,7 @@
 
 #include "joystick.h"
 #include "tasks.h"
+#include "isr_timing.h"
 
 // The joystick has no effect when the position is central +/- threshold.
 #define ZERO_THRESHOLD	0x50
@@ -205,6 +206,7 @@ static void joystick_isr(void) {
 		}
 	}
 }
+ISR_TIMING_WRAPPER(joystick_isr, ISR_TIMING_JOYSTICK)
 
 void joystick_init(void) {
 
@@ -261,7 +263,7 @@ void joystick_init(void) {
 
 	// Create a 10ms timer callback
 	TimerLoadSet64(JOY_TIMER, SysCtlClockGet() / 500);
-	TimerIntRegister(JOY_TIMER, TIMER_A, joystick_isr);
+	TimerIntRegister(JOY_TIMER, TIMER_A, ISR_TIMING_HANDLER(joystick_isr));
 	TimerIntEnable(JOY_TIMER, TIMER_TIMA_TIMEOUT);
 	IntPrioritySet(INT_TIMER3A, CONFIG_JOY_PRIORITY);
 	TimerEnable(JOY_TIMER, TIMER_A);
@@ -37,6 +37,7 @@
 #include "joystick.h"
 #include "tasks.h"
 #include "lcd.h"
+#include "isr_timing.h"
 
 #if defined(PART_TM4C123GH6PM)
 #include "inc/tm4c123gh6pm.h"
@@ -87,6 +88,9 @@ int main(void)
     GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_3 | GPIO_PIN_2 | GPIO_PIN_1, 0);
 
     /* Initialize GRBL */
+#ifdef CONFIG_ISR_TIMING
+    isr_timing_init();
+#endif
     tasks_init();
 
     joystick_init();
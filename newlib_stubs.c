@@ -57,7 +57,7 @@ int _write(int file, char *ptr, int len) {
 
     switch (file) {
     case STDOUT_FILENO: /*stdout*/
-    	serial_write((const uint8_t*)ptr, len);
+    	serial_write((const uint8_t*)ptr, len, SERIAL_TX_DEBUG);
     	break;
 
     case STDERR_FILENO:
@@ -22,8 +22,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include "planner.h"
+#include "trapezoid.h"
 #include "stepper.h"
 #include "sense_control.h"
+#include "tasks.h"
 #include "config.h"
 
 
@@ -46,17 +48,38 @@ static int32_t position[3];             // The current position of the tool in a
 static volatile bool position_update_requested;  // make sure to update to stepper position on next occasion
 static double previous_unit_vec[3];     // Unit vector of previous path line segment
 static double previous_nominal_speed;   // Nominal speed of previous path line segment
+static double previous_acceleration;    // Acceleration of previous path line segment
+static double previous_junction_deviation;  // Junction deviation of previous path line segment
+
+static uint32_t line_number = 0;        // sequence number of the G-code line queueing blocks
+
+static bool estimate_mode = false;      // blocks are timed instead of executed (dry run)
+static double estimate_seconds;         // accumulated time of the retired blocks
+
+// The trapezoids planner_apply_overrides computes, before they are swapped into the blocks
+typedef struct {
+  uint32_t nominal_rate;
+  uint32_t nominal_rate_inverse;
+  uint32_t initial_rate;
+  uint32_t final_rate;
+  uint32_t accelerate_until;
+  uint32_t decelerate_after;
+} profile_t;
+static profile_t override_profile[BLOCK_BUFFER_SIZE];
+
+volatile uint8_t feed_override = OVERRIDE_DEFAULT;    // Real-time feed override in percent
+volatile uint8_t power_override = OVERRIDE_DEFAULT;   // Real-time laser power override in percent
 
 // prototypes for static functions (non-accesible from other files)
 static int8_t next_block_index(int8_t block_index);
-static int8_t prev_block_index(int8_t block_index);
-static double estimate_acceleration_distance(double initial_rate, double target_rate, double acceleration);
-static double intersection_distance(double initial_rate, double final_rate, double acceleration, double distance);
-static double max_allowable_speed(double acceleration, double target_velocity, double distance);
-static void calculate_trapezoid_for_block(block_t *block, double entry_factor, double exit_factor);
-static void reduce_entry_speed_reverse(block_t *current, block_t *next);
-static void reduce_entry_speed_forward(block_t *previous, block_t *current);
 static void planner_recalculate();
+static void estimate_retire_block();
+static double override_speed(double programmed_speed, uint8_t percent);
+static uint32_t rate_inverse(uint32_t rate);
+static void planner_dwell_block(uint32_t dwell_us, uint8_t nominal_laser_intensity, uint8_t z_motor);
+#ifdef MOTOR_Z
+static void planner_motor_z(int32_t target);
+#endif
 
 
 // Add a new linear movement to the buffer. x, y and z is 
@@ -94,11 +117,17 @@ static void planner_movement(double x, double y, double z,
   target[Y_AXIS] = lround(y*y_steps_per_mm);
   target[Z_AXIS] = lround(z*CONFIG_Z_STEPS_PER_MM); 
 
+#ifdef MOTOR_Z
+  // The Z motor is timed rather than stepped, it runs on its own ahead of the XY move.
+  planner_motor_z(target[Z_AXIS]);
+#endif
+
   // calculate the buffer head and check for space
   int next_buffer_head = next_block_index( block_buffer_head ); 
   while(block_buffer_tail == next_buffer_head) {  // buffer full condition
     // good! We are well ahead of the robot. Rest here until buffer has room.
-    // sleep_mode();
+    STEPPER_WAIT();
+    if (estimate_mode) { estimate_retire_block(); }
   }
   
   block_buffers_used++;
@@ -112,6 +141,7 @@ static void planner_movement(double x, double y, double z,
   
   // prepare to set up new block
   block_t *block = &block_buffer[block_buffer_head];
+  block->line = line_number;
   
   // Setup the block type
   if (raster == NULL) {
@@ -130,8 +160,6 @@ static void planner_movement(double x, double y, double z,
   if (target[Y_AXIS] < position[Y_AXIS]) { block->direction_bits |= (1<<STEP_Y_DIR); }
 #ifndef MOTOR_Z
   if (target[Z_AXIS] < position[Z_AXIS]) { block->direction_bits |= (1<<STEP_Z_DIR); }
-#else
-  if (target[Z_AXIS] < position[Z_AXIS]) { block->direction_bits |= STEP_Z_MASK; }
 #endif
   
   // number of steps for each axis
@@ -153,12 +181,15 @@ static void planner_movement(double x, double y, double z,
   
   // calculate nominal_speed (mm/min) and nominal_rate (step/min)
   // minimum stepper speed is limited by MINIMUM_STEPS_PER_MINUTE in stepper.c
-  block->nominal_speed = feed_rate; // always > 0
-  block->nominal_rate = ceil(feed_rate * x_steps_per_mm); // always > 0
+  block->programmed_speed = feed_rate;
+  block->feed_override = feed_override;
+  block->nominal_speed = override_speed(feed_rate, block->feed_override); // always > 0
+  block->nominal_rate = ceil(block->nominal_speed * x_steps_per_mm); // always > 0
+  block->nominal_rate_inverse = rate_inverse(block->nominal_rate);
 
   block->acceleration = acceleration;
-  // compute the acceleration rate for this block. (steps/min/min / ticks/min)
-  block->rate_delta = ceil( block->acceleration * CONFIG_X_STEPS_PER_MM / (ACCELERATION_TICKS_PER_SECOND * 60));
+  // the acceleration in step events, scaled like nominal_rate (steps/min^2)
+  block->acceleration_st = max(min(ceil(block->acceleration * x_steps_per_mm), (double)UINT32_MAX), 1);
 
   // Calculate the ppi steps
   block->laser_mmpp = 0;
@@ -184,7 +215,12 @@ static void planner_movement(double x, double y, double z,
   // path width or max_jerk in the previous grbl version. This approach does not actually deviate 
   // from path, but used as a robust way to compute cornering speeds, as it takes into account the
   // nonlinearities of both the junction angle and junction velocity.
+  // Moves with the laser off corner with the seek deviation. Where two moves with different
+  // settings meet, the smaller deviation and acceleration apply.
+  double junction_deviation = (nominal_laser_intensity == 0 && raster == NULL)
+                              ? CONFIG_SEEK_JUNCTION_DEVIATION : CONFIG_JUNCTION_DEVIATION;
   double vmax_junction = ZERO_SPEED; // prime for junctions close to 0 degree
+  block->junction_limit = ZERO_SPEED;
   if ((block_buffer_head != block_buffer_tail) && (previous_nominal_speed > 0.0)) {
     // Compute cosine of angle between previous and current path.
     // vmax_junction is computed without sin() or acos() by trig half angle identity.
@@ -193,20 +229,22 @@ static void planner_movement(double x, double y, double z,
                        - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
     if (cos_theta < 0.95) {
       // any junction *not* close to 0 degree
-      vmax_junction = min(previous_nominal_speed, block->nominal_speed);  // prime for close to 180
+      block->junction_limit = CONFIG_MAX_SEEKRATE;  // prime for close to 180
       if (cos_theta > -0.95) {
         // any junction not close to neither 0 and 180 degree -> compute vmax
         double sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
-        vmax_junction = min( vmax_junction, sqrt( block->acceleration * CONFIG_JUNCTION_DEVIATION
-                                                  * sin_theta_d2/(1.0-sin_theta_d2) ) );
+        block->junction_limit = sqrt( min(block->acceleration, previous_acceleration)
+                                      * min(junction_deviation, previous_junction_deviation)
+                                      * sin_theta_d2/(1.0-sin_theta_d2) );
       }
+      vmax_junction = min(block->junction_limit, min(previous_nominal_speed, block->nominal_speed));
     }
   }
   block->vmax_junction = vmax_junction;
   
   // Initialize entry_speed. Compute based on deceleration to zero.
   // This will be updated in the forward and reverse planner passes.
-  double v_allowable = max_allowable_speed(-block->acceleration, ZERO_SPEED, block->millimeters);
+  double v_allowable = trapezoid_max_allowable_speed(-block->acceleration, ZERO_SPEED, block->millimeters);
   block->entry_speed = min(vmax_junction, v_allowable);
 
   // Set nominal_length_flag for more efficiency.
@@ -220,6 +258,8 @@ static void planner_movement(double x, double y, double z,
   // update previous unit_vector and nominal speed
   memcpy(previous_unit_vec, unit_vec, sizeof(unit_vec)); // previous_unit_vec[] = unit_vec[]
   previous_nominal_speed = block->nominal_speed;
+  previous_acceleration = block->acceleration;
+  previous_junction_deviation = junction_deviation;
   //// end of acceleeration manager calculations
 
 
@@ -230,7 +270,7 @@ static void planner_movement(double x, double y, double z,
   planner_recalculate();
 
   // make sure the stepper interrupt is processing
-  stepper_wake_up();
+  if (!estimate_mode) { stepper_wake_up(); }
 }
 
 void planner_init() {
@@ -246,19 +286,22 @@ void planner_init() {
   position_update_requested = false;
   clear_vector_double(previous_unit_vec);
   previous_nominal_speed = 0.0;
+  previous_acceleration = CONFIG_DEFAULT_ACCELERATION;
+  previous_junction_deviation = CONFIG_JUNCTION_DEVIATION;
 }
 
 int8_t last_raster = 0;
 
 // Process a raster.
 // Rasters can be +/- in the x or y directions (not z).
+// The run-ups before and after the raster line are laser off, they use seek_acceleration.
 void planner_raster(double x, double y, double z,
-                    double feed_rate, double acceleration,
+                    double feed_rate, double acceleration, double seek_acceleration,
                     uint8_t nominal_laser_intensity,
                     raster_t *raster) {
     double raster_len = 0;
     double head = 0;
-    double ramp = pow(feed_rate, 2) / (2 * acceleration);
+    double ramp = pow(feed_rate, 2) / (2 * seek_acceleration);
     uint8_t bidirectional = (raster->bidirectional > 0)?1:0;
 
     // Calculate how much to offset each raster by to compensate for laser lag
@@ -292,12 +335,12 @@ void planner_raster(double x, double y, double z,
     if (last_raster <= 0)
     {
         // We need to go forwards.
-        planner_movement(x - ramp - offset, y, z, feed_rate, acceleration, 0, 0, NULL);
-        planner_movement(x - offset, y, z, feed_rate, acceleration, 0, 0, NULL);
+        planner_movement(x - ramp - offset, y, z, feed_rate, seek_acceleration, 0, 0, NULL);
+        planner_movement(x - offset, y, z, feed_rate, seek_acceleration, 0, 0, NULL);
     } else {
         // We need to go backwards.
-        planner_movement(x + raster_len + ramp + offset, y, z, feed_rate, acceleration, 0, 0, NULL);
-        planner_movement(x + raster_len + offset, y, z, feed_rate, acceleration, 0, 0, NULL);
+        planner_movement(x + raster_len + ramp + offset, y, z, feed_rate, seek_acceleration, 0, 0, NULL);
+        planner_movement(x + raster_len + offset, y, z, feed_rate, seek_acceleration, 0, 0, NULL);
     }
 
     // Copy the data into our buffer
@@ -309,7 +352,7 @@ void planner_raster(double x, double y, double z,
                 memcpy(raster_buffer[raster_buffer_next], raster->buffer, raster->length);
             } else {
                 uint32_t i;
-                uint8_t *dst = raster_buffer[raster_buffer_next] + raster->length;
+                uint8_t *dst = raster_buffer[raster_buffer_next] + raster->length - 1;
                 uint8_t *src = raster->buffer;
                 for (i=0; i<raster->length; ++i)
                 {
@@ -321,6 +364,10 @@ void planner_raster(double x, double y, double z,
             if (raster_buffer_next == NUM_RASTERS)
                 raster_buffer_next = 0;
             break;
+        } else if (estimate_mode) {
+            estimate_retire_block();
+        } else {
+            STEPPER_WAIT();
         }
     }
 
@@ -331,7 +378,7 @@ void planner_raster(double x, double y, double z,
     {
         // We need to go forwards.
         planner_movement(x + raster_len - offset, y, z, feed_rate, acceleration, 0, 0, raster);
-        planner_movement(x + raster_len + ramp - offset, y, z, feed_rate, acceleration, 0, 0, NULL);
+        planner_movement(x + raster_len + ramp - offset, y, z, feed_rate, seek_acceleration, 0, 0, NULL);
 
         if (bidirectional != 0) {
         	last_raster = 1;
@@ -339,7 +386,7 @@ void planner_raster(double x, double y, double z,
     } else {
         // We need to go backwards.
         planner_movement(x + offset, y, z, feed_rate, acceleration, 0, 0, raster);
-        planner_movement(x - ramp + offset, y, z, feed_rate, acceleration, 0, 0, NULL);
+        planner_movement(x - ramp + offset, y, z, feed_rate, seek_acceleration, 0, 0, NULL);
 
         if (bidirectional != 0) {
         	last_raster = -1;
@@ -357,17 +404,89 @@ void planner_line(double x, double y, double z,
 }
 
 
+// Add a dwell (pierce) to the buffer. The laser is held at nominal_laser_intensity
+// for the given time while the head stands still. Timing is done by the stepper
+// interrupt so the main loop is not blocked.
 void planner_dwell(double seconds, uint8_t nominal_laser_intensity) {
-// // Execute dwell in seconds. Maximum time delay is > 18 hours, more than enough for any application.
-// void mc_dwell(double seconds) {
-//    uint16_t i = floor(seconds);
-//    stepper_synchronize();
-//    _delay_ms(floor(1000*(seconds-i))); // Delay millisecond remainder
-//    while (i > 0) {
-//      _delay_ms(1000); // Delay one second
-//      i--;
-//    }
-// }  
+  if (seconds <= 0.0) { return; }
+  planner_dwell_block(lround(seconds * 1000000.0), nominal_laser_intensity, 0);
+}
+
+#ifdef MOTOR_Z
+// Queue the run of the Z motor to target (its steps are milliseconds of running) as a dwell
+// that drives the H-bridge. The stepper timer ends it, the next block waits for it.
+static void planner_motor_z(int32_t target) {
+  if (position_update_requested) {
+    planner_set_position(stepper_get_position_x(), stepper_get_position_y(), stepper_get_position_z());
+    position_update_requested = false;
+  }
+  if (target == position[Z_AXIS]) { return; }
+
+  planner_dwell_block(labs(target - position[Z_AXIS]) * 1000, 0,
+                      (target < position[Z_AXIS]) ? STEP_Z_DOWN : STEP_Z_UP);
+  position[Z_AXIS] = target;
+}
+#endif
+
+// Add a timed block, the head stands still. z_motor is the H-bridge output (MOTOR_Z).
+static void planner_dwell_block(uint32_t dwell_us, uint8_t nominal_laser_intensity, uint8_t z_motor) {
+  // calculate the buffer head and check for space
+  int next_buffer_head = next_block_index( block_buffer_head );
+  while(block_buffer_tail == next_buffer_head) {  // buffer full condition
+    // good! We are well ahead of the robot. Rest here until buffer has room.
+    STEPPER_WAIT();
+    if (estimate_mode) { estimate_retire_block(); }
+  }
+
+  // handle position update after a stop
+  if (position_update_requested) {
+    planner_set_position(stepper_get_position_x(), stepper_get_position_y(), stepper_get_position_z());
+    position_update_requested = false;
+  }
+
+  // prepare to set up new block
+  block_t *block = &block_buffer[block_buffer_head];
+  block->line = line_number;
+  block->block_type = BLOCK_TYPE_DWELL;
+  block->laser_pwm = nominal_laser_intensity;
+  block->laser_ppi = 0;
+  block->laser_mmpp = 0;
+  block->dwell_us = dwell_us;
+#ifdef MOTOR_Z
+  block->z_motor = z_motor;
+#endif
+
+  // No motion, the head must be at rest on entry and exit.
+  block->direction_bits = 0;
+  block->steps_x = 0;
+  block->steps_y = 0;
+  block->steps_z = 0;
+  block->step_event_count = 0;
+  block->nominal_rate = 0;
+  block->nominal_rate_inverse = 0;
+  block->nominal_speed = 0.0;
+  block->programmed_speed = 0.0;
+  block->feed_override = feed_override;
+  block->millimeters = 0.0;
+  block->junction_limit = ZERO_SPEED;
+  block->vmax_junction = ZERO_SPEED;
+  block->entry_speed = ZERO_SPEED;
+  // The previous block decelerates into the dwell with its own acceleration.
+  block->acceleration = previous_acceleration;
+  block->nominal_length_flag = true;
+  block->recalculate_flag = false;
+
+  // the next block has to start from zero speed
+  previous_nominal_speed = 0.0;
+  clear_vector_double(previous_unit_vec);
+
+  // move buffer head
+  block_buffer_head = next_buffer_head;
+
+  planner_recalculate();
+
+  // make sure the stepper interrupt is processing
+  if (!estimate_mode) { stepper_wake_up(); }
 }
 
 
@@ -376,7 +495,8 @@ void planner_command(uint8_t type) {
   int next_buffer_head = next_block_index( block_buffer_head ); 
   while(block_buffer_tail == next_buffer_head) {  // buffer full condition
     // good! We are well ahead of the robot. Rest here until buffer has room.
-    // sleep_mode();
+    STEPPER_WAIT();
+    if (estimate_mode) { estimate_retire_block(); }
   }    
 
   // Prepare to set up new block
@@ -384,12 +504,13 @@ void planner_command(uint8_t type) {
 
   // set block type command
   block->block_type = type;
+  block->line = line_number;
 
   // Move buffer head
   block_buffer_head = next_buffer_head;
 
-  // make sure the stepper interrupt is processing  
-  stepper_wake_up();
+  // make sure the stepper interrupt is processing
+  if (!estimate_mode) { stepper_wake_up(); }
 }
 
 
@@ -403,6 +524,14 @@ int planner_blocks_available(void) {
         return block_buffer_tail - next_buffer_head;
 }
 
+int planner_blocks_queued(void) {
+    return BLOCK_BUFFER_SIZE - 1 - planner_blocks_available();
+}
+
+void planner_set_line_number(uint32_t number) {
+    line_number = number;
+}
+
 /*
 ----T****H-----
 **H---------T**
@@ -458,221 +587,169 @@ void planner_request_position_update() {
 }
 
 
-
-// Returns the index of the next block in the ring buffer.
-static int8_t next_block_index(int8_t block_index) {
-  block_index++;
-  if (block_index == BLOCK_BUFFER_SIZE) { block_index = 0; }  // cheaper than module (%)
-  return block_index;
+void planner_set_feed_override(uint8_t percent) {
+  feed_override = min(max(percent, OVERRIDE_MIN), OVERRIDE_MAX);
+  // The segment prep picks up the new value on its next segment, the queue is replanned from the main loop.
+  task_enable(TASK_PLANNER_OVERRIDE, 0);
 }
 
-// Returns the index of the previous block in the ring buffer
-static int8_t prev_block_index(int8_t block_index) {
-  if (block_index == 0) { block_index = BLOCK_BUFFER_SIZE; }
-  block_index--;
-  return block_index;
+void planner_set_power_override(uint8_t percent) {
+  power_override = min(max(percent, OVERRIDE_MIN), OVERRIDE_MAX);
 }
 
+// Replan the blocks that have not been started yet for the current feed override.
+// The segment prep replans the block being executed, with its exit speed scaled by the same
+// ratio as the entry speed of the first queued block here.
+// The segment prep keeps running meanwhile. The speeds are replanned in place (the prep
+// doesn't read them), the new trapezoids go to override_profile and are swapped in at
+// once, if the prep hasn't taken the first block meanwhile. Otherwise replan from the
+// block it will take next: the old trapezoids it runs are all still in place.
+void planner_apply_overrides(void) {
+  uint8_t override;
+  uint8_t first_index, block_index;
+  bool committed;
+
+  do {
+    override = feed_override;
+    first_index = block_buffer_tail_write;  // the block the prep takes next
+    if (first_index == block_buffer_head) { return; }  // nothing queued
+
+    // The block being executed (if any) is what we enter the first queued block from.
+    double previous_speed = 0.0;
+    if (block_buffer_tail != first_index) {
+      block_t *executing = &block_buffer[block_buffer_tail];
+      if (executing->block_type == BLOCK_TYPE_LINE || executing->block_type == BLOCK_TYPE_RASTER_LINE) {
+        previous_speed = override_speed(executing->programmed_speed, override);
+      }
+    }
 
-/*            target rate -> +
-**                          /|
-**                         / |                 
-**                        /  |   
-**                       /   |
-**      initial rate -> +----+           
-**                           ^                   
-**                           |                   
-**                       DISTANCE 
-*/
-// Calculates the distance (not time) it takes to accelerate from initial_rate to target_rate
-static double estimate_acceleration_distance(double initial_rate, double target_rate, double acceleration) {
-  return( (target_rate*target_rate-initial_rate*initial_rate)/(2*acceleration) );
-}
-
+    bool first = true;
+    for (block_index = first_index; block_index != block_buffer_head; block_index = next_block_index(block_index)) {
+      block_t *block = &block_buffer[block_index];
+      if (block->block_type == BLOCK_TYPE_LINE || block->block_type == BLOCK_TYPE_RASTER_LINE) {
+        block->nominal_speed = override_speed(block->programmed_speed, override);
 
+        if (previous_speed > 0.0) {
+          block->vmax_junction = min(block->junction_limit, min(previous_speed, block->nominal_speed));
+        } else {
+          block->vmax_junction = ZERO_SPEED;
+        }
 
-/*                        + <- some maximum rate we don't care about
-**                       /|\
-**                      / | \                    
-**                     /  |  + <- final_rate     
-**                    /   |  |                   
-**   initial_rate -> +----+--+                   
-**                        ^  ^                   
-**                        |  |                   
-**    INTERSECTION_DISTANCE  distance
-*/
-// This function gives you the point at which you must start braking (at the rate of -acceleration) if 
-// you started at speed initial_rate and accelerated until this point and want to end at the final_rate after
-// a total travel of distance. This can be used to compute the intersection point between acceleration and
-// deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
-static double intersection_distance(double initial_rate, double final_rate, double acceleration, double distance) {
-  return( (2*acceleration*distance-initial_rate*initial_rate+final_rate*final_rate)/(4*acceleration) );
-}
+        double v_allowable = trapezoid_max_allowable_speed(-block->acceleration, ZERO_SPEED, block->millimeters);
+        if (first) {
+          // keep the junction with the executing block continuous, from the trapezoid it was planned with
+          double entry_speed = block->initial_rate / x_steps_per_mm * override / block->feed_override;
+          block->entry_speed = min(entry_speed, block->nominal_speed);
+        } else {
+          block->entry_speed = min(block->vmax_junction, v_allowable);
+        }
+        block->nominal_length_flag = (block->nominal_speed <= v_allowable);
+        previous_speed = block->nominal_speed;
+        first = false;
+      } else if (block->block_type == BLOCK_TYPE_DWELL) {
+        previous_speed = 0.0;
+        first = false;
+      }
+    }
+    trapezoid_plan_speeds(block_buffer, BLOCK_BUFFER_SIZE, first_index, block_buffer_head);
+
+    // the trapezoids, on a copy of each block
+    for (block_index = first_index; block_index != block_buffer_head; block_index = next_block_index(block_index)) {
+      block_t *block = &block_buffer[block_index];
+      if (block->block_type == BLOCK_TYPE_LINE || block->block_type == BLOCK_TYPE_RASTER_LINE) {
+        uint8_t next_index = next_block_index(block_index);
+        double exit_speed = (next_index == block_buffer_head) ? ZERO_SPEED : block_buffer[next_index].entry_speed;
+        block_t planned = *block;
+        planned.nominal_rate = ceil(block->nominal_speed * x_steps_per_mm);
+        trapezoid_calculate_block(&planned, block->entry_speed/block->nominal_speed,
+                                  exit_speed/block->nominal_speed);
+        override_profile[block_index].nominal_rate = planned.nominal_rate;
+        override_profile[block_index].nominal_rate_inverse = rate_inverse(planned.nominal_rate);
+        override_profile[block_index].initial_rate = planned.initial_rate;
+        override_profile[block_index].final_rate = planned.final_rate;
+        override_profile[block_index].accelerate_until = planned.accelerate_until;
+        override_profile[block_index].decelerate_after = planned.decelerate_after;
+      }
+      block->recalculate_flag = false;
+    }
 
-            
-
-/*                      + <- MAX_ALLOWABLE_SPEED
-**                      |\
-**                      | \                    
-**                      |  \    
-**                      |   \                  
-**                      +----+ <- target velocity            
-**                           ^                   
-**                           |                   
-**                       distance 
-*/
-// Calculate the beginning speed that results in target_velocity when accelerated over given distance.
-static double max_allowable_speed(double acceleration, double target_velocity, double distance) {
-  return( sqrt(target_velocity*target_velocity-2*acceleration*distance) );
+    // swap them in, a few us
+    stepper_prep_hold();
+    committed = (block_buffer_tail_write == first_index);
+    if (committed) {
+      for (block_index = first_index; block_index != block_buffer_head; block_index = next_block_index(block_index)) {
+        block_t *block = &block_buffer[block_index];
+        if (block->block_type == BLOCK_TYPE_LINE || block->block_type == BLOCK_TYPE_RASTER_LINE) {
+          block->nominal_rate = override_profile[block_index].nominal_rate;
+          block->nominal_rate_inverse = override_profile[block_index].nominal_rate_inverse;
+          block->initial_rate = override_profile[block_index].initial_rate;
+          block->final_rate = override_profile[block_index].final_rate;
+          block->accelerate_until = override_profile[block_index].accelerate_until;
+          block->decelerate_after = override_profile[block_index].decelerate_after;
+          block->feed_override = override;
+        }
+      }
+    }
+    stepper_prep_release();
+  } while (!committed);
 }
 
 
 
-/*                                        
-**                                   +--------+   <- nominal_rate
-**                                  /|        |\                                
-**  nominal_rate*entry_factor ->   + |        | \                               
-**                                 | |        |  + <- nominal_rate*exit_factor  
-**                                 +-+--------+--+                              
-**                                   ^        ^
-**                                   |        |
-**                      accelerate_until    decelerate_after                           
-*/                                                                              
-// Calculates accelerate_until and decelerate_after.
-static void calculate_trapezoid_for_block(block_t *block, double entry_factor, double exit_factor) {
-  block->initial_rate = ceil(block->nominal_rate * entry_factor);  // (step/min)
-  block->final_rate = ceil(block->nominal_rate * exit_factor);     // (step/min)
-  int32_t acceleration_per_minute = block->rate_delta * ACCELERATION_TICKS_PER_SECOND * 60; // (step/min^2)
-  int32_t accelerate_steps = 
-    ceil(estimate_acceleration_distance(block->initial_rate, block->nominal_rate, acceleration_per_minute));
-  int32_t decelerate_steps = 
-    floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration_per_minute));
-    
-  // Calculate the size of Plateau of Nominal Rate. 
-  int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
-  
-  // Handle special case where we don't reach a plateau.
-  if (plateau_steps < 0) {  
-    accelerate_steps = ceil( intersection_distance( block->initial_rate, block->final_rate, 
-                             acceleration_per_minute, block->step_event_count ) );
-    accelerate_steps = max(accelerate_steps, 0);  // check limits due to numerical round-off
-    accelerate_steps = min(accelerate_steps, block->step_event_count);
-    plateau_steps = 0;
-  }  
-  
-  block->accelerate_until = accelerate_steps;
-  block->decelerate_after = accelerate_steps+plateau_steps;
+// Scale the programmed speed by the feed override, limited to what the machine can do.
+static double override_speed(double programmed_speed, uint8_t percent) {
+  return min(programmed_speed * percent / 100.0, CONFIG_MAX_SEEKRATE);
 }
 
+// 2^32/rate, saturated. The stepper multiplies the current rate by this
+// to get the fraction of nominal speed without dividing.
+static uint32_t rate_inverse(uint32_t rate) {
+  if (rate <= 1) { return UINT32_MAX; }
+  return ((uint64_t)1 << 32) / rate;
+}
 
-static void reduce_entry_speed_reverse(block_t *current, block_t *next) {
-  // 'next' here is the newer/later block, not the next in the iteration
-  //                   time->
-  //     [tail][][][current][next][][][][head] -> loops around to tail
-  //     processing ->                  queuing->
-  //  
-  // Reduce entry_speed if necessary so next entry_speed can definitely be reached with
-  // fixed acceleration. This is specifically relevant for short blocks that never plateau.
-  // Skip if we already flagged the block as plateauing or vmax <= next entry_speed. 
-  if ((!current->nominal_length_flag) && (current->vmax_junction > next->entry_speed)) {
-    current->entry_speed = min( current->vmax_junction, max_allowable_speed(
-                  -next->acceleration, next->entry_speed, current->millimeters) );
-  } else {
-    current->entry_speed = current->vmax_junction;
-  } 
-  current->recalculate_flag = true;
-  // no worries about last block, forward pass takes care of it
+// Returns the index of the next block in the ring buffer.
+static int8_t next_block_index(int8_t block_index) {
+  block_index++;
+  if (block_index == BLOCK_BUFFER_SIZE) { block_index = 0; }  // cheaper than module (%)
+  return block_index;
 }
 
 
-static void reduce_entry_speed_forward(block_t *previous, block_t *current) {
-  // 'previous' here is the older/earlier block, not the previous in the iteration
-  //                   time->
-  //     [tail][][][previous][current][][][][head] -> loops around to tail
-  //     processing ->                  queuing->
-  //  
-  // Reduce entry_speed if necessary so it can be reached from previous entry_speed  with
-  // fixed acceleration. This is specifically relevant for short blocks that never plateau.
-  // Skip if we already flagged the previous block as plateauing or entry_speed <= previous entry_speed.   
-  if (!previous->nominal_length_flag) {
-    if (previous->entry_speed < current->entry_speed) {
-      double entry_speed = min( current->entry_speed,
-        max_allowable_speed(-current->acceleration, previous->entry_speed, previous->millimeters) );
-      // Check for junction speed change
-      if (current->entry_speed != entry_speed) {
-        current->entry_speed = entry_speed;
-        current->recalculate_flag = true;
-      }
-    }    
+
+// Start a dry run. Blocks are planned as usual but timed and dropped instead of executed.
+void planner_estimate_begin(void) {
+  stepper_synchronize();
+  estimate_seconds = 0.0;
+  estimate_mode = true;
+}
+
+// End the dry run and return the time (seconds) the stepper would have needed.
+// The planner position is resynced to the real machine position.
+double planner_estimate_end(void) {
+  if (!estimate_mode) { return 0.0; }
+  while (block_buffer_tail != block_buffer_head) {
+    estimate_retire_block();
   }
+  estimate_mode = false;
+  position_update_requested = true;
+  return estimate_seconds;
 }
 
+bool planner_estimate_active(void) {
+  return estimate_mode;
+}
+
+// Time and drop the oldest block, standing in for the stepper in estimate mode.
+// Blocks are retired only when the buffer is full (or at the end) so they get
+// the same look-ahead as when streaming to the stepper.
+static void estimate_retire_block() {
+  if (block_buffer_tail == block_buffer_head) { return; }
+  estimate_seconds += trapezoid_block_seconds(&block_buffer[block_buffer_tail]);
+  planner_discard_current_block();
+}
 
 // planner, called whenever a new block was added
-// All planner computations are performed with doubles (float on Arduinos) to minimize numerical round-
-// off errors. Only when planned values are converted to stepper rate parameters, these are integers.
 static void planner_recalculate() {
-  //// reverse pass
-  // Recalculate entry_speed to be (a) less or equal to vmax_junction and
-  // (b) low enough so it can definitely reach the next entry_speed at fixed acceleration.
-  int8_t block_index = block_buffer_head;
-  block_t *previous = NULL;  // block closer to tail (older)
-  block_t *current = NULL;   // block who's entry_speed to be adjusted
-  block_t *next = NULL;      // block closer to head (newer)
-  while(block_index != block_buffer_tail_write) {
-    block_index = prev_block_index( block_index );
-    next = current;
-    current = previous;
-    previous = &block_buffer[block_index];
-    if (current && next) {
-      reduce_entry_speed_reverse(current, next);
-    }
-  } // skip tail/first block
-  
-  //// forward pass
-  // Recalculate entry_speed to be low enough it can definitely 
-  // be reached from previous entry_speed at fixed acceleration.
-  block_index = block_buffer_tail_write;
-  previous = NULL;  // block closer to tail (older)
-  current = NULL;   // block who's entry_speed to be adjusted
-  next = NULL;      // block closer to head (newer)
-  while(block_index != block_buffer_head) {
-    previous = current;
-    current = next;
-    next = &block_buffer[block_index];
-    if (previous && current) {
-      reduce_entry_speed_forward(previous, current);
-    }
-    block_index = next_block_index(block_index);
-  }
-  if (current && next) {
-    reduce_entry_speed_forward(current, next);
-  }
-  
-  //// recalculate trapeziods for all flagged blocks
-  // At this point all blocks have entry_speeds that that can be (a) reached from the prevous
-  // entry_speed with the one and only acceleration from our settings and (b) have junction
-  // speeds that do not exceed our limits for given direction change.
-  // Now we only need to calculate the actual accelerate_until and decelerate_after values.
-  block_index = block_buffer_tail_write;
-  current = NULL;
-  next = NULL;
-  while(block_index != block_buffer_head) {
-    current = next;
-    next = &block_buffer[block_index];
-    if (current) {
-      if (current->recalculate_flag || next->recalculate_flag) {
-        calculate_trapezoid_for_block( current, 
-            current->entry_speed/current->nominal_speed, 
-            next->entry_speed/current->nominal_speed );      
-        current->recalculate_flag = false;
-      }
-    }
-    block_index = next_block_index( block_index );
-  }
-  // always recalculate last (newest) block with zero exit speed
-  calculate_trapezoid_for_block( next, 
-    next->entry_speed/next->nominal_speed, ZERO_SPEED/next->nominal_speed );
-  next->recalculate_flag = false;
+  trapezoid_recalculate(block_buffer, BLOCK_BUFFER_SIZE, block_buffer_tail_write, block_buffer_head);
 }
-
@@ -28,6 +28,11 @@
 // This needs to be the minimum buffers required for the largest command (raster)
 #define PLANNER_FIFO_READY_THRESHOLD		4
 
+// Real-time override limits, in percent of the programmed feed rate / laser power.
+#define OVERRIDE_DEFAULT	100
+#define OVERRIDE_MIN		10
+#define OVERRIDE_MAX		200
+
 // Command types the planner and stepper can schedule for execution
 typedef enum {
 	BLOCK_TYPE_LINE,
@@ -36,6 +41,7 @@ typedef enum {
 	BLOCK_TYPE_AIR_ASSIST_DISABLE,
 	BLOCK_TYPE_AUX1_ASSIST_ENABLE,
 	BLOCK_TYPE_AUX1_ASSIST_DISABLE,
+	BLOCK_TYPE_DWELL,
 } BLOCK_TYPE;
 
 // Raster structure, used by gcode, planner and stepper.
@@ -66,23 +72,32 @@ typedef struct {
   uint8_t  direction_bits;            // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
   int32_t  step_event_count;          // The number of step events required to complete this block
   uint32_t nominal_rate;              // The nominal step rate for this block in step_events/minute
+  uint32_t nominal_rate_inverse;      // 2^32/nominal_rate, to scale laser power with speed (multiply-shift)
   // Fields used by the motion planner to manage acceleration
   double nominal_speed;               // The nominal speed for this block in mm/min  
+  double programmed_speed;            // The feed rate as requested by the g-code, before overrides
+  uint8_t feed_override;              // The feed override (percent) the block was planned with
   double entry_speed;                 // Entry speed at previous-current junction in mm/min
   double vmax_junction;               // max junction speed (mm/min) based on angle between segments, accel and deviation settings
+  double junction_limit;              // vmax_junction before limiting to the nominal speeds (angle and accel only)
   double millimeters;                 // The total travel of this block in mm
   uint8_t laser_pwm;    			  // 0-255 is 0-100% percentage
   uint32_t laser_ppi;           	  // Number of pulses per inch
-  uint32_t laser_mmpp;           	  // Number of mm per pulse (calculated from ppi)
+  double laser_mmpp;           	  // Number of mm per pulse (calculated from ppi)
   bool recalculate_flag;              // Planner flag to recalculate trapezoids on entry junction
   bool nominal_length_flag;           // Planner flag for nominal speed always reached
   // Settings for the trapezoid generator
   uint32_t initial_rate;              // The jerk-adjusted step rate at start of block  
   uint32_t final_rate;                // The minimal rate at exit
-  int32_t rate_delta;                 // The steps/minute to add or subtract when changing speed (must be positive)
+  uint32_t acceleration_st;           // Acceleration in step events/min^2 (> 0)
   uint32_t accelerate_until;          // The index of the step event on which to stop acceleration
   uint32_t decelerate_after;          // The index of the step event on which to start decelerating
   double acceleration;          	  // Acceleration speed (mm/min/min)
+  uint32_t dwell_us;                  // Duration of a dwell block in microseconds
+  uint32_t line;                      // Sequence number of the G-code line that queued the block
+#ifdef MOTOR_Z
+  uint8_t z_motor;                    // Dwell blocks: H-bridge output (STEP_Z_UP/DOWN) for the duration, 0 if none
+#endif
   raster_t raster;
 } block_t;
 
@@ -92,8 +107,9 @@ void planner_init();
 // Process a raster.
 // Rasters can be +/- in the x or y directions (not z).
 // raster and raster_len contain the pointer and length of buffer containing 0-255 PWM values for each dot.
+// The run-ups (laser off) use seek_acceleration.
 void planner_raster(double x, double y, double z,
-		            double feed_rate, double acceleration,
+		            double feed_rate, double acceleration, double seek_acceleration,
 		            uint8_t nominal_laser_intensity,
 		            raster_t *raster);
 
@@ -105,6 +121,7 @@ void planner_line(double x, double y, double z,
 		          uint8_t laser_pwm, uint16_t laser_ppi);
 
 // Add a new piercing action, lasing at one spot.
+// The head comes to a full stop before the dwell and starts from zero speed after it.
 void planner_dwell(double seconds, uint8_t nominal_laser_intensity);
 
 // Add a non-motion command to the queue.
@@ -114,6 +131,11 @@ void planner_command(uint8_t type);
 
 
 int planner_blocks_available(void);
+int planner_blocks_queued(void);
+
+// Sequence number of the G-code line, stamped on the blocks queued from now on.
+// The stepper reports the line it executes in stepper_state_t.
+void planner_set_line_number(uint32_t number);
 
 // Gets the current block. Returns NULL if buffer empty
 block_t *planner_get_current_block();
@@ -133,4 +155,21 @@ void planner_set_position(double x, double y, double z);
 // called from the stepper code that executes the stop
 void planner_request_position_update();
 
+// Real-time overrides (percent). The segment prep ramps to a new feed override from its next segment.
+extern volatile uint8_t feed_override;
+extern volatile uint8_t power_override;
+
+// Change the overrides, safe to call from an ISR.
+// Blocks not yet started are replanned later by planner_apply_overrides().
+void planner_set_feed_override(uint8_t percent);
+void planner_set_power_override(uint8_t percent);
+
+// Estimate mode (dry run): plan blocks and accumulate their execution time without stepping.
+void planner_estimate_begin(void);
+double planner_estimate_end(void);
+bool planner_estimate_active(void);
+
+// Re-derive speeds and trapezoids of the queued blocks for the current feed override.
+void planner_apply_overrides(void);
+
 #endif
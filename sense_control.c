@@ -34,28 +34,41 @@
 #include <driverlib/pin_map.h>
 
 #include "config.h"
+#include "fastio.h"
 
 #include "sense_control.h"
 #include "stepper.h"
 #include "planner.h"
+#include "isr_timing.h"
 
 uint8_t sense_ignore = 0;
+volatile uint8_t sense_state = 0;
 
-static uint32_t laser_cycles;
-static uint32_t laser_divider;
+static uint8_t sense_release_pending = 0;   // Sensors that were released but not yet cleared
+static uint32_t sense_release_time;         // When they were released (ms)
 
-static uint32_t ppi_cycles;
-static uint32_t ppi_divider;
+static uint32_t laser_cycles;       // PWM period, 24 bits (the prescaler extends the timer in PWM mode)
+static uint32_t laser_frequency;    // PWM frequency (Hz)
+
+static uint32_t ppi_cycles;         // PPI pulse timer load (prescaled cycles)
+static uint32_t ppi_pulse_length;   // The pulse length the PPI timer is set up for (us)
 
 static uint8_t laser_intensity = 0;
+static uint32_t laser_match[256];   // PWM match value for each intensity, see CONFIG_LASER_POWER_CURVE
+
+static void laser_build_match_table(void);
+static void ppi_timer_setup(uint32_t pulse_length);
+static void sense_isr(void);
+ISR_TIMING_WRAPPER(sense_isr, ISR_TIMING_SENSE)
 
 // Laser pulse one-shot timer.
 static void laser_isr(void) {
-    TimerIntClear(LASER_TIMER, TIMER_TIMB_TIMEOUT);
+    fastio_timer_int_clear(LASER_TIMER, TIMER_TIMB_TIMEOUT);
 
     // Turn off the Laser
-    GPIOPinWrite(LASER_EN_PORT, LASER_EN_MASK, LASER_EN_INVERT);
+    fastio_write(LASER_EN_PORT, LASER_EN_MASK, LASER_EN_INVERT);
 }
+ISR_TIMING_WRAPPER(laser_isr, ISR_TIMING_LASER)
 
 
 void sense_init() {
@@ -66,6 +79,68 @@ void sense_init() {
     //// x1_lmit, x2_limit, y1_limit, y2_limit, z1_limit, z2_limit
     GPIOPinTypeGPIOInput(LIMIT_PORT, LIMIT_MASK);
     GPIOPadConfigSet(LIMIT_PORT, LIMIT_MASK, GPIO_STRENGTH_4MA, GPIO_PIN_TYPE_STD_WPU);
+
+    sense_state = sense_read();
+
+    // Latch the sensors on every edge, both ports share the handler.
+    GPIOIntTypeSet(SENSE_PORT, SENSE_MASK, GPIO_BOTH_EDGES);
+    GPIOIntTypeSet(LIMIT_PORT, LIMIT_MASK, GPIO_BOTH_EDGES);
+    GPIOIntRegister(SENSE_PORT, ISR_TIMING_HANDLER(sense_isr));
+    GPIOIntRegister(LIMIT_PORT, ISR_TIMING_HANDLER(sense_isr));
+    IntPrioritySet(INT_GPIOE, CONFIG_SENSE_PRIORITY);
+    IntPrioritySet(INT_GPIOC, CONFIG_SENSE_PRIORITY);
+    GPIOIntEnable(SENSE_PORT, SENSE_MASK);
+    GPIOIntEnable(LIMIT_PORT, LIMIT_MASK);
+}
+
+uint8_t sense_read(void) {
+    uint8_t limits = fastio_read(LIMIT_PORT, LIMIT_MASK);
+    uint8_t state = 0;
+
+    if (limits & (1 << X_LIMIT_BIT)) state |= SENSE_STATE_X_LIMIT;
+    if (limits & (1 << Y_LIMIT_BIT)) state |= SENSE_STATE_Y_LIMIT;
+    if (!(limits & (1 << Z_LIMIT_BIT))) state |= SENSE_STATE_Z_LIMIT;   // active low
+    if (limits & (1 << E_LIMIT_BIT)) state |= SENSE_STATE_E_LIMIT;
+    if (fastio_read(SENSE_PORT, SENSE_MASK)) state |= SENSE_STATE_DOOR_OPEN;
+    return state;
+}
+
+// Sensor pin edge, also pended by sense_debounce_tick() while a release is pending.
+// Triggering is latched right away, releasing only after SENSE_DEBOUNCE_MS.
+static void sense_isr(void) {
+    uint8_t active, released;
+
+    // Clear first, so an edge during the read runs the handler again.
+    GPIOIntClear(SENSE_PORT, SENSE_MASK);
+    GPIOIntClear(LIMIT_PORT, LIMIT_MASK);
+
+    active = sense_read();
+    released = sense_state & ~active;
+
+    if (released != sense_release_pending) {
+        // (newly) released, or bouncing: restart the debounce time
+        sense_release_pending = released;
+        sense_release_time = system_time_ms;
+    } else if (released != 0 && system_time_ms - sense_release_time >= SENSE_DEBOUNCE_MS) {
+        sense_state = active;
+        sense_release_pending = 0;
+        return;
+    }
+    sense_state |= active;
+
+#ifndef DEBUG_IGNORE_SENSORS
+    // The stepper ISR stops or holds on its next run, a step period from now or a dwell
+    // chunk (100ms). The beam goes off right away.
+    if (SENSE_LIMITS || SENSE_SAFETY) {
+        control_laser(0, 0);
+    }
+#endif
+}
+
+void sense_debounce_tick(void) {
+    if (sense_release_pending) {
+        IntPendSet(INT_GPIOC);
+    }
 }
 
 void control_init() {
@@ -88,27 +163,16 @@ void control_init() {
     // PPI = PWMfreq/(feedrate/MM_PER_INCH/60)
 
     // Set PPI Pulse timer
-    ppi_cycles = SysCtlClockGet() / CONFIG_LASER_PPI_PULSE_US;
-    ppi_divider = ppi_cycles >> 16;
-    ppi_cycles /= (ppi_divider + 1);
-    TimerPrescaleSet(LASER_TIMER, TIMER_B, ppi_divider);
-    TimerLoadSet(LASER_TIMER, TIMER_B, ppi_cycles);
+    ppi_timer_setup(CONFIG_LASER_PPI_PULSE_US);
 
     // Setup ISR
-    TimerIntRegister(LASER_TIMER, TIMER_B, laser_isr);
+    TimerIntRegister(LASER_TIMER, TIMER_B, ISR_TIMING_HANDLER(laser_isr));
     TimerIntEnable(LASER_TIMER, TIMER_TIMB_TIMEOUT);
     IntPrioritySet(INT_TIMER0B, CONFIG_LASER_PRIORITY);
 
-    // Set PWM refresh rate
-    laser_cycles = SysCtlClockGet() / CONFIG_LASER_PWM_FREQ; /*Hz*/
-    laser_divider = laser_cycles >> 16;
-    laser_cycles /= (laser_divider + 1);
-
-    // Setup Laser PWM Timer
-    TimerPrescaleSet(LASER_TIMER, TIMER_A, laser_divider);
-    TimerLoadSet(LASER_TIMER, TIMER_A, laser_cycles);
-    TimerPrescaleMatchSet(LASER_TIMER, TIMER_A, laser_divider);
+    // Set PWM refresh rate, this builds the match table
     laser_intensity = 0;
+    control_laser_frequency(CONFIG_LASER_PWM_FREQ);
 
     // Set default value
     control_laser_intensity(255);   // Used to detect R9 presence.
@@ -127,11 +191,45 @@ void control_init() {
 }
 
 void control_laser_intensity(uint8_t intensity) {
+    uint32_t match = laser_match[intensity];
     laser_intensity = intensity;
-    if (intensity == 0) intensity = 1;
 
     // Set the PWM (Intensity).
-    TimerMatchSet(LASER_TIMER, TIMER_A, laser_cycles - (laser_cycles * intensity / 255));
+    fastio_timer_prescale_match(LASER_TIMER, TIMER_A, match >> 16);
+    fastio_timer_match(LASER_TIMER, TIMER_A, match & 0xffff);
+}
+
+// Set the PWM frequency (Hz). In PWM mode the prescaler holds bits 23:16 of the
+// period, so this goes down to clock/2^24 (5Hz at 80MHz).
+void control_laser_frequency(uint32_t frequency) {
+    laser_frequency = frequency;
+    laser_cycles = min(SysCtlClockGet() / frequency, 0xffffff);
+
+    TimerPrescaleSet(LASER_TIMER, TIMER_A, laser_cycles >> 16);
+    TimerLoadSet(LASER_TIMER, TIMER_A, laser_cycles & 0xffff);
+    laser_build_match_table();
+    control_laser_intensity(laser_intensity);
+}
+
+uint32_t control_get_frequency(void) {
+    return laser_frequency;
+}
+
+// Precompute the PWM match values so setting the intensity is a table lookup.
+// The power curve is interpolated linearly between its calibration points.
+static void laser_build_match_table(void) {
+    static const uint8_t curve[] = CONFIG_LASER_POWER_CURVE;
+    const uint16_t points = sizeof(curve) - 1;
+    uint16_t intensity;
+
+    for (intensity = 0; intensity < 256; intensity++) {
+        uint32_t position = intensity * points * 256 / 255;   // curve index in 1/256
+        uint16_t index = min(position >> 8, points - 1);
+        uint32_t fraction = position - (index << 8);
+        uint32_t duty = (curve[index] * (256 - fraction) + curve[index + 1] * fraction) >> 8;
+        if (duty == 0) duty = 1;  // the PWM can't do 0%, the laser is disabled instead
+        laser_match[intensity] = laser_cycles - (laser_cycles * duty / 255);
+    }
 }
 
 uint8_t control_get_intensity(void) {
@@ -142,23 +240,37 @@ void control_laser(uint8_t on_off, uint32_t pulse_length) {
 
     // If required, (re)set the PPI timer.
     if (pulse_length > 0) {
-        ppi_cycles = SysCtlClockGet() / pulse_length;
-        ppi_divider = ppi_cycles >> 16;
-        ppi_cycles /= (ppi_divider + 1);
-        TimerPrescaleSet(LASER_TIMER, TIMER_B, ppi_divider);
-
+        if (pulse_length != ppi_pulse_length) {
+            ppi_timer_setup(pulse_length);
+        }
         // Schedule a timer to turn off the laser
-        TimerLoadSet(LASER_TIMER, TIMER_B, ppi_cycles);
+        fastio_timer_load(LASER_TIMER, TIMER_B, ppi_cycles);
         // Clear any interrupts to avoid a race.
         // This function is called from a higher priority ISR.
-        TimerIntClear(LASER_TIMER, TIMER_TIMB_TIMEOUT);
+        fastio_timer_int_clear(LASER_TIMER, TIMER_TIMB_TIMEOUT);
     }
 
     // Control the beam enable.
     if (on_off == 0)
-        GPIOPinWrite(LASER_EN_PORT, LASER_EN_MASK, LASER_EN_INVERT);
+        fastio_write(LASER_EN_PORT, LASER_EN_MASK, LASER_EN_INVERT);
     else
-        GPIOPinWrite(LASER_EN_PORT, LASER_EN_MASK, LASER_EN_MASK ^ LASER_EN_INVERT);
+        fastio_write(LASER_EN_PORT, LASER_EN_MASK, LASER_EN_MASK ^ LASER_EN_INVERT);
+
+    // Start the pulse, the one-shot stops itself.
+    if (pulse_length > 0) {
+        fastio_timer_enable(LASER_TIMER, TIMER_B);
+    }
+}
+
+// Set up the PPI pulse timer for a pulse length (us). The one-shot timer is 16 bits,
+// longer pulses use the prescaler.
+static void ppi_timer_setup(uint32_t pulse_length) {
+    uint32_t cycles = pulse_length * (SysCtlClockGet() / 1000000);
+    uint32_t divider = cycles >> 16;
+
+    ppi_pulse_length = pulse_length;
+    ppi_cycles = cycles / (divider + 1);
+    TimerPrescaleSet(LASER_TIMER, TIMER_B, divider);
 }
 
 
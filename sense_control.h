@@ -20,24 +20,40 @@
 
 #include <stdbool.h>
 #include "config.h"
+#include "fastio.h"
+
+// The sensor state word, bits are set while a sensor is triggered.
+#define SENSE_STATE_X_LIMIT     0x01
+#define SENSE_STATE_Y_LIMIT     0x02
+#define SENSE_STATE_Z_LIMIT     0x04
+#define SENSE_STATE_E_LIMIT     0x08
+#define SENSE_STATE_DOOR_OPEN   0x10
 
 extern uint8_t sense_ignore;
+// Latched by the sensor pin interrupts: a sensor is set as soon as it triggers
+// and cleared once it has been released for SENSE_DEBOUNCE_MS.
+extern volatile uint8_t sense_state;
 
 void sense_init();
-#define SENSE_X_LIMIT (GPIOPinRead(LIMIT_PORT, (1 << X_LIMIT_BIT)) != 0)
-#define SENSE_Y_LIMIT (GPIOPinRead(LIMIT_PORT, (1 << Y_LIMIT_BIT)) != 0)
-#define SENSE_Z_LIMIT (GPIOPinRead(LIMIT_PORT, (1 << Z_LIMIT_BIT)) == 0)
-#define SENSE_E_LIMIT (GPIOPinRead(LIMIT_PORT, (1 << E_LIMIT_BIT)) != 0)
-#define SENSE_DOOR_OPEN (GPIOPinRead(SENSE_PORT, (1 << DOOR_BIT)) != 0)
+void sense_debounce_tick(void);  // called every 1ms
+uint8_t sense_read(void);        // the undebounced sensor pins, as a state word
+
+#define SENSE_X_LIMIT ((sense_state & SENSE_STATE_X_LIMIT) != 0)
+#define SENSE_Y_LIMIT ((sense_state & SENSE_STATE_Y_LIMIT) != 0)
+#define SENSE_Z_LIMIT ((sense_state & SENSE_STATE_Z_LIMIT) != 0)
+#define SENSE_E_LIMIT ((sense_state & SENSE_STATE_E_LIMIT) != 0)
+#define SENSE_DOOR_OPEN ((sense_state & SENSE_STATE_DOOR_OPEN) != 0)
 #define SENSE_CHILLER_OFF (temperature_read(0) > (20 * 16))
 // invert door, remove power, add z_limits
 //#define SENSE_LIMITS (SENSE_X_LIMIT || SENSE_Y_LIMIT || SENSE_Z_LIMIT || SENSE_E_LIMIT)
-#define SENSE_LIMITS ((sense_ignore == 0) && (SENSE_X_LIMIT || SENSE_Y_LIMIT))
+#define SENSE_LIMITS ((sense_ignore == 0) && (sense_state & (SENSE_STATE_X_LIMIT | SENSE_STATE_Y_LIMIT)))
 #define SENSE_SAFETY (/*SENSE_CHILLER_OFF ||*/ SENSE_DOOR_OPEN)
 
 void control_init();
 
 void control_laser_intensity(uint8_t intensity);  //0-255 is 0-100%
+void control_laser_frequency(uint32_t frequency); // PWM frequency (Hz)
+uint32_t control_get_frequency(void);
 void control_laser(uint8_t on_off, uint32_t pulse_length);
 uint8_t control_get_intensity(void);
 
@@ -45,6 +45,7 @@
 
 #include "serial.h"
 #include "stepper.h"
+#include "planner.h"
 #include "gcode.h"
 #include "tasks.h"
 
@@ -57,7 +58,33 @@
 //*****************************************************************************
 static volatile bool g_bUSBConfigured = false;
 
-static uint32_t txByte(const uint8_t data);
+static uint32_t rx_scan_index = 0;     // Next byte of the receive ring to check for real-time commands
+static uint8_t rx_scan_last = 0;       // The byte before rx_scan_index
+
+// The print functions build the response here and hand it to the USB buffer
+// as a whole on '\n', instead of one USBBufferWrite per character.
+static uint8_t tx_line[SERIAL_TX_LINE_SIZE];
+static uint32_t tx_line_length = 0;
+static uint8_t tx_line_class = SERIAL_TX_RESPONSE;
+static bool tx_line_split = false;  // the queue ends in the middle of a line, more of it follows
+
+// Lines wait here for room in the USB buffer, so a slow host doesn't hold up
+// the main loop. The indices run freely, the ring is a power of 2 in size.
+static uint8_t tx_queue[SERIAL_TX_QUEUE_SIZE];
+static uint32_t tx_head = 0;
+static uint32_t tx_tail = 0;
+
+// Only the latest status line is kept.
+static uint8_t tx_status[SERIAL_TX_LINE_SIZE];
+static uint32_t tx_status_length = 0;
+
+static uint32_t tx_dropped = 0;     // Debug output dropped for lack of room
+static uint32_t tx_coalesced = 0;   // Status lines replaced before they were sent
+
+static void tx_pump(void);
+static void tx_line_commit(bool split);
+static void txByte(const uint8_t data);
+static void scan_realtime_commands(void);
 
 void serial_init() {
     /* Enable the USB peripheral and PLL */
@@ -87,51 +114,160 @@ void serial_init() {
     IntPrioritySet(INT_USB0, CONFIG_USB_PRIORITY);
 }
 
-uint32_t serial_write(const uint8_t *pStr, uint32_t length)
+// Hand as much of the queue to the USB buffer as it has room for, then the
+// latest status line once the responses before it are out. Never waits.
+static void tx_pump(void)
 {
-    unsigned long buffAvailSize;
-    uint32_t bufferedCount = 0;
-    uint32_t sendCount = 0;
-    uint8_t *sendPtr;
-
-    if (!g_bUSBConfigured)
-#if 1
-    	return 0;
-#else
-        USBCDCD_waitForConnect();
-#endif
-
-    GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_1, GPIO_PIN_1);
-
-    while (bufferedCount != length) {
-        /* Determine the buffer size available */
-        buffAvailSize = USBBufferSpaceAvailable(&g_sTxBuffer);
-
-        /* Determine how much needs to be sent */
-        if ((length - bufferedCount) > buffAvailSize) {
-            sendCount = buffAvailSize;
+    uint32_t space;
+    uint32_t count;
+
+    if (!g_bUSBConfigured) {
+        // nobody is listening, forget what was queued
+        tx_tail = tx_head;
+        tx_status_length = 0;
+        return;
+    }
+
+    while (tx_head != tx_tail) {
+        space = USBBufferSpaceAvailable(&g_sTxBuffer);
+        if (space == 0) {
+            return;
         }
-        else {
-            sendCount = length - bufferedCount;
+
+        // the part up to the end of the ring or the head, whichever is first
+        count = SERIAL_TX_QUEUE_SIZE - (tx_tail & (SERIAL_TX_QUEUE_SIZE - 1));
+        if (count > tx_head - tx_tail) {
+            count = tx_head - tx_tail;
         }
+        if (count > space) {
+            count = space;
+        }
+
+        GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_1, GPIO_PIN_1);
+        tx_tail += USBBufferWrite(&g_sTxBuffer,
+                                  &tx_queue[tx_tail & (SERIAL_TX_QUEUE_SIZE - 1)], count);
+    }
+
+    // A status line goes out whole and not while the rest of a split line is still
+    // being printed, so it can't end up inside another one.
+    if (tx_status_length > 0 && !tx_line_split
+        && USBBufferSpaceAvailable(&g_sTxBuffer) >= tx_status_length) {
+        GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_1, GPIO_PIN_1);
+        USBBufferWrite(&g_sTxBuffer, tx_status, tx_status_length);
+        tx_status_length = 0;
+    }
+}
+
+static void tx_enqueue(const uint8_t *pStr, uint32_t length)
+{
+    while (length-- > 0) {
+        tx_queue[tx_head++ & (SERIAL_TX_QUEUE_SIZE - 1)] = *pStr++;
+    }
+}
+
+// Queue the line printed so far. split is set if it's the first part of a line
+// longer than the buffer, the rest follows.
+static void tx_line_commit(bool split)
+{
+    uint32_t line_length = tx_line_length;
+
+    if (line_length > 0) {
+        tx_line_length = 0;
+        tx_line_split = split;
+        serial_write(tx_line, line_length, tx_line_class);
+    }
+}
+
+// Queue pStr according to its class, see SERIAL_TX_RESPONSE and friends.
+// Returns the number of bytes queued.
+uint32_t serial_write(const uint8_t *pStr, uint32_t length, uint8_t tx_class)
+{
+    uint32_t count;
+
+    if (!g_bUSBConfigured) {
+        return 0;
+    }
+
+    // keep the order with what was printed before
+    tx_line_commit(false);
+
+    switch (tx_class) {
+        case SERIAL_TX_STATUS:
+            if (length > SERIAL_TX_LINE_SIZE) {
+                tx_dropped++;
+                return 0;
+            }
+            if (tx_status_length > 0) {
+                tx_coalesced++;  // the host hasn't taken the previous one yet
+            }
+            memcpy(tx_status, pStr, length);
+            tx_status_length = length;
+            break;
 
-        /* Adjust the pointer to the data */
-        sendPtr = (uint8_t *)pStr + bufferedCount;
+        case SERIAL_TX_DEBUG:
+            if (SERIAL_TX_QUEUE_SIZE - (tx_head - tx_tail) < length + SERIAL_TX_RESERVE) {
+                tx_dropped++;
+                return 0;
+            }
+            tx_enqueue(pStr, length);
+            break;
 
-        /* Place the contents into the USB BUffer */
-        bufferedCount += USBBufferWrite(&g_sTxBuffer, sendPtr, sendCount);
+        default:
+            // Responses are never dropped. Only a host that stopped reading
+            // altogether can fill the queue, then wait for it.
+            for (count = 0; count < length; ) {
+                uint32_t room = SERIAL_TX_QUEUE_SIZE - (tx_head - tx_tail);
+                if (room == 0) {
+                    tx_pump();
+                    if (!g_bUSBConfigured) {
+                        return count;
+                    }
+                    continue;
+                }
+                if (room > length - count) {
+                    room = length - count;
+                }
+                tx_enqueue(pStr + count, room);
+                count += room;
+            }
+            break;
     }
 
-    return (bufferedCount);
+    tx_pump();
+    return length;
+}
+
+// Queue the pending line and pass what fits on to the USB buffer. Called from
+// the main loop, so the queue drains as the host reads. Whatever was printed by
+// then counts as complete, a status line may follow it.
+void serial_flush(void)
+{
+    tx_line_commit(false);
+    tx_pump();
+}
+
+// Class of the line being printed, it applies until its '\n'.
+void serial_line_class(uint8_t tx_class)
+{
+    tx_line_commit(false);
+    tx_line_class = tx_class;
+}
+
+void serial_tx_counters(uint32_t *dropped, uint32_t *coalesced)
+{
+    *dropped = tx_dropped;
+    *coalesced = tx_coalesced;
 }
 
 void printString(const char *s) {
-	serial_write((const uint8_t *)s, strlen(s));
+  while (*s) {
+    txByte(*s++);
+  }
 }
 
 // Print a string stored in PGM-memory
 void printPgmString(const char *s) {
-	serial_write((const uint8_t *)s, strlen(s));
+  printString(s);
 }
 
 void printIntegerInBase(unsigned long n, unsigned long base) {
@@ -162,31 +298,49 @@ void printInteger(long n) {
   printIntegerInBase(n, 10);
 }
 
+// Three decimals, rounded half up. The value is taken apart from its IEEE 754 bits,
+// mantissa / 2^shift, so there is no soft-float math, only integer shifts and multiplies.
+// Values of 2^32 and more (and inf, nan) print as 4294967295.999.
 void printFloat(double n) {
-  if (n < 0) {
+  uint64_t bits;
+  uint64_t mantissa;
+  int32_t shift;
+  unsigned long integer_part = 0;
+  uint32_t decimal_part = 0;
+
+  memcpy(&bits, &n, sizeof(bits));
+  if ((bits >> 63) && (bits << 1) != 0) {  // negative, not -0
 	  txByte('-');
-    n = -n;
   }
-  n += 0.5/1000; // Add rounding factor
 
-  long integer_part;
-  integer_part = (int)n;
-  printIntegerInBase(integer_part,10);
+  // 11 bits of exponent biased by 1023, 52 bits of mantissa with an implicit leading 1
+  shift = 1075 - (int32_t)((bits >> 52) & 0x7FF);
+  mantissa = (bits & 0xFFFFFFFFFFFFFULL) | (1ULL << 52);
+  if (shift <= 20) {  // 2^32 or more
+    integer_part = 0xFFFFFFFFUL;
+    decimal_part = 999;
+  } else if (shift < 64) {
+    // the fraction has at most 53 bits, times 1000 fits in 64
+    uint64_t fraction = mantissa & ((1ULL << shift) - 1);
+    integer_part = mantissa >> shift;
+    decimal_part = (fraction * 1000 + (1ULL << (shift - 1))) >> shift;
+    if (decimal_part >= 1000) {  // rounded up into the next integer
+      if (integer_part < 0xFFFFFFFFUL) {
+        integer_part++;
+        decimal_part -= 1000;
+      } else {
+        decimal_part = 999;
+      }
+    }
+  }  // else less than 0.0005 (or denormal), 0.000
+  printIntegerInBase(integer_part, 10);
 
   txByte('.');
-
-  n -= integer_part;
-  int decimals = 3;
-  uint8_t decimal_part;
-  while(decimals-- > 0) {
-    n *= 10;
-    decimal_part = (int) n;
-    txByte('0'+decimal_part);
-    n -= decimal_part;
-  }
+  txByte('0' + decimal_part / 100);
+  txByte('0' + decimal_part / 10 % 10);
+  txByte('0' + decimal_part % 10);
 }
 
-
 static tLineCoding g_sLineCoding =
 {
     115200,                     /* 115200 baud rate. */
@@ -381,6 +535,7 @@ RxHandler(void *pvCBData, uint32_t ui32Event, uint32_t ui32MsgValue,
         // A new packet has been received.
         //
         case USB_EVENT_RX_AVAILABLE:
+            scan_realtime_commands();
             GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_3, GPIO_PIN_3);
             task_enable(TASK_SERIAL_RX, (void*)&g_sRxBuffer);
             break;
@@ -419,7 +574,59 @@ RxHandler(void *pvCBData, uint32_t ui32Event, uint32_t ui32MsgValue,
     return(0);
 }
 
-static uint32_t txByte(uint8_t data)
+static void txByte(uint8_t data)
+{
+	tx_line[tx_line_length++] = data;
+	if (data == '\n') {
+		tx_line_commit(false);
+		tx_line_class = SERIAL_TX_RESPONSE;
+	} else if (tx_line_length == SERIAL_TX_LINE_SIZE) {
+		if (tx_line_class == SERIAL_TX_STATUS) {
+			tx_line_length--;  // a status line is sent whole, it is cut to the buffer
+		} else {
+			tx_line_commit(true);
+		}
+	}
+}
+
+// Apply a real-time override command. Returns false if chr is not one.
+static bool realtime_command(uint8_t chr)
 {
-	return serial_write(&data, 1);
+    switch (chr) {
+        case CMD_FEED_OVR_RESET:         planner_set_feed_override(OVERRIDE_DEFAULT); break;
+        case CMD_FEED_OVR_COARSE_PLUS:   planner_set_feed_override(feed_override + 10); break;
+        case CMD_FEED_OVR_COARSE_MINUS:  planner_set_feed_override(feed_override - 10); break;
+        case CMD_FEED_OVR_FINE_PLUS:     planner_set_feed_override(feed_override + 1); break;
+        case CMD_FEED_OVR_FINE_MINUS:    planner_set_feed_override(feed_override - 1); break;
+        case CMD_POWER_OVR_RESET:        planner_set_power_override(OVERRIDE_DEFAULT); break;
+        case CMD_POWER_OVR_COARSE_PLUS:  planner_set_power_override(power_override + 10); break;
+        case CMD_POWER_OVR_COARSE_MINUS: planner_set_power_override(power_override - 10); break;
+        case CMD_POWER_OVR_FINE_PLUS:    planner_set_power_override(power_override + 1); break;
+        case CMD_POWER_OVR_FINE_MINUS:   planner_set_power_override(power_override - 1); break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Look at the bytes that just arrived in the receive ring and act on any
+// real-time commands immediately, even if the line parser is stalled on a
+// full planner. Handled commands are replaced by CMD_HANDLED so the parser skips them.
+// The byte following '*' or '^' is a line checksum and may be >= 0x80.
+static void scan_realtime_commands(void)
+{
+    tUSBRingBufObject ring;
+
+    USBBufferInfoGet(&g_sRxBuffer, &ring);
+    while (rx_scan_index != ring.ui32WriteIndex) {
+        uint8_t chr = ring.pui8Buf[rx_scan_index];
+        if (chr >= 0x80 && rx_scan_last != '*' && rx_scan_last != '^') {
+            if (realtime_command(chr)) {
+                ring.pui8Buf[rx_scan_index] = CMD_HANDLED;
+            }
+        }
+        rx_scan_last = chr;
+        rx_scan_index++;
+        if (rx_scan_index == ring.ui32Size) { rx_scan_index = 0; }
+    }
 }
@@ -25,8 +25,37 @@
 
 #include <stdint.h>
 
+// Real-time override commands. Single bytes that are picked out of the
+// receive stream as soon as they arrive, they never reach the line parser.
+#define CMD_FEED_OVR_RESET          0x90    // Restore programmed feed rate
+#define CMD_FEED_OVR_COARSE_PLUS    0x91    // +10%
+#define CMD_FEED_OVR_COARSE_MINUS   0x92    // -10%
+#define CMD_FEED_OVR_FINE_PLUS      0x93    // +1%
+#define CMD_FEED_OVR_FINE_MINUS     0x94    // -1%
+#define CMD_POWER_OVR_RESET         0x99    // Restore programmed laser power
+#define CMD_POWER_OVR_COARSE_PLUS   0x9A    // +10%
+#define CMD_POWER_OVR_COARSE_MINUS  0x9B    // -10%
+#define CMD_POWER_OVR_FINE_PLUS     0x9C    // +1%
+#define CMD_POWER_OVR_FINE_MINUS    0x9D    // -1%
+
+// A real-time command is overwritten with this in the receive ring once it is
+// acted on. The line parser drops it, it's neither part of a line nor of its checksum.
+#define CMD_HANDLED                 0x00
+
+#define SERIAL_TX_LINE_SIZE         128     // Longer responses go out in pieces, status lines are cut
+#define SERIAL_TX_QUEUE_SIZE        1024    // Power of 2
+#define SERIAL_TX_RESERVE           256     // Room in the queue debug output leaves to responses
+
+// Transmit classes
+#define SERIAL_TX_RESPONSE          0       // Acks and errors, never dropped
+#define SERIAL_TX_STATUS            1       // Periodic status, only the latest is kept
+#define SERIAL_TX_DEBUG             2       // Dropped when the queue runs short
+
 void serial_init();
-uint32_t serial_write(const uint8_t *pStr, uint32_t length);
+uint32_t serial_write(const uint8_t *pStr, uint32_t length, uint8_t tx_class);
+void serial_flush(void);
+void serial_line_class(uint8_t tx_class);
+void serial_tx_counters(uint32_t *dropped, uint32_t *coalesced);
 
 void printString(const char *s);
 void printPgmString(const char *s);
@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include "inc/hw_nvic.h"
 #include "inc/hw_types.h"
+#include "isr_timing.h"
 
 //*****************************************************************************
 //
@@ -42,6 +43,7 @@ static void IntDefaultHandler(void);
 //
 //*****************************************************************************
 extern void USB0DeviceIntHandler(void);
+ISR_TIMING_WRAPPER(USB0DeviceIntHandler, ISR_TIMING_USB)
 
 
 //*****************************************************************************
@@ -128,7 +130,7 @@ void (* const g_pfnVectors[])(void) =
     IntDefaultHandler,                      // CAN2
     0,                                      // Reserved
     IntDefaultHandler,                      // Hibernate
-    USB0DeviceIntHandler,                   // USB0
+    ISR_TIMING_HANDLER(USB0DeviceIntHandler), // USB0
     IntDefaultHandler,                      // PWM Generator 3
     IntDefaultHandler,                      // uDMA Software Transfer
     IntDefaultHandler,                      // uDMA Error
@@ -33,11 +33,18 @@
   
                              time ----->
 
-  The speed profile starts at block->initial_rate, accelerates by block->rate_delta
+  The speed profile starts at block->initial_rate, accelerates by block->acceleration_st
   during the first block->accelerate_until step_events_completed, then keeps going at constant speed until
   step_events_completed reaches block->decelerate_after after which it decelerates until final_rate is reached.
-  The slope of acceleration is always +/- block->rate_delta and is applied at a constant rate following the midpoint rule.
-  Speed adjustments are made ACCELERATION_TICKS_PER_SECOND times per second.  
+  The acceleration is constant per step: rate^2 changes by 2*acceleration_st with every step event.
+
+  The speed profile is not evaluated in the stepper interrupt itself. The segment prep, a lower
+  priority interrupt, cuts the blocks into segments of about 1/ACCELERATION_TICKS_PER_SECOND,
+  with constant laser power, ending on raster dot changes and where the profile changes from
+  accelerating to cruising to decelerating. It sets the exact rate at the start of each segment.
+  The stepper interrupt traces the steps of the segment and ramps the step period in between with
+  the recurrence c' = c - 2c/(4n+1) (D. Austin, "Generate stepper-motor speed profiles in real
+  time"), in fixed point: an add, a shift and a hardware divide per interrupt.
 */
 
 #define __DELAY_BACKWARD_COMPATIBLE__  // _delay_us() make backward compatible see delay.h
@@ -53,25 +60,86 @@
 #include <inc/hw_timer.h>
 #include <inc/hw_ints.h>
 #include <inc/hw_gpio.h>
+#include <inc/hw_udma.h>
 
 #include <driverlib/gpio.h>
 #include <driverlib/rom.h>
 #include <driverlib/sysctl.h>
 #include <driverlib/timer.h>
 #include <driverlib/interrupt.h>
+#include <driverlib/udma.h>
 
 #include "config.h"
+#include "fastio.h"
 #include "stepper.h"
 #include "gcode.h"
 #include "planner.h"
+#include "trapezoid.h"
 #include "sense_control.h"
 #include "temperature.h"
 #include "tasks.h"
 #include "joystick.h"
+#include "isr_timing.h"
+
+
+// Dwells are timed in chunks, the beam is re-applied with each one.
+#define DWELL_CHUNK_US      100000
+// Delay before the block following a dwell is started.
+#define DWELL_RELEASE_US    100
+// The first step timer period after the stepper was idle.
+#define WAKE_UP_US          100
+
+// Fixed point step timer period (Q8 cycles) while the stepper ISR ramps, periods up to 2^24 cycles.
+// The ramp index (interrupts from standstill) is limited so 4n+1 fits 32 bits, the rate
+// barely changes from one interrupt to the next beyond it.
+#define RAMP_FRACTION_BITS  8
+#define RAMP_INDEX_MAX      (1UL << 29)
+#define RAMP_PERIOD_MAX     (0xffffffffUL / 2)
+
+// Fixed point (Q16) step event positions of the PPI pulses.
+#define PPI_FRACTION_BITS   16
+#define PPI_ONE             (1ULL << PPI_FRACTION_BITS)
+
+// Adaptive multi-axis step smoothing: below these step rates (cycles per step event) the
+// stepper interrupt is oversampled 2x, 4x or 8x. The interrupt rate stays below 16kHz.
+#ifdef CONFIG_STEPPER_AMASS
+#define MAX_AMASS_LEVEL     3
+#define AMASS_LEVEL1        (125 * cycles_per_microsecond)  // 8kHz
+#define AMASS_LEVEL2        (250 * cycles_per_microsecond)  // 4kHz
+#define AMASS_LEVEL3        (500 * cycles_per_microsecond)  // 2kHz
+#else
+#define MAX_AMASS_LEVEL     0
+#endif
+
+// Number of segments between the segment prep and the stepper ISR. Each segment lasts about one
+// acceleration tick (or one step at low rates), this is also the latency of the real-time overrides.
+#define SEGMENT_BUFFER_SIZE 8
+
+// Homing moves: each axis steps on until HOMING_OVERSHOOT steps after its limit switch triggered
+// (or released when backing off). The approach fails if the switches aren't found within the table size.
+#define HOMING_OVERSHOOT    24
+#define HOMING_AXES         (SENSE_STATE_X_LIMIT | SENSE_STATE_Y_LIMIT)
+#define HOMING_TRAVEL_X     ((CONFIG_X_MAX - CONFIG_X_MIN) * 1.1)
+#define HOMING_TRAVEL_Y     ((CONFIG_Y_MAX - CONFIG_Y_MIN) * 1.1)
 
+// Feed hold: on a safety issue the head decelerates to a stop and waits, then the job
+// resumes from standstill where it was held.
+typedef enum
+{
+    HOLD_NONE,
+    HOLD_DECELERATING,  // the segment prep ramps the rate down, the laser is off
+    HOLD_STOPPED        // standing still, the stepper ISR waits for the issue to clear
+} HOLD_STATE;
 
-#define CYCLES_PER_MICROSECOND (SysCtlClockGet()/1000000)  // 80MHz = 80
-#define CYCLES_PER_ACCELERATION_TICK (SysCtlClockGet()/ACCELERATION_TICKS_PER_SECOND)  // 80MHz/100 = 800000
+typedef enum
+{
+    HOMING_IDLE,
+    HOMING_START,       // waiting for the queued blocks
+    HOMING_APPROACH,    // fast, toward the switches
+    HOMING_BACK_OFF,    // fast, until the switches release
+    HOMING_LOCATE,      // slow, toward the switches
+    HOMING_PULL_OFF     // slow, until the switches release
+} HOMING_PHASE;
 
 typedef enum
 {
@@ -81,50 +149,149 @@ typedef enum
     STEP_NUM_AXIS
 } STEP_AXIS;
 
-static int64_t stepper_position[STEP_NUM_AXIS];  // real-time position in absolute steps
-static block_t *current_block;  // A pointer to the block currently being traced
+// The part of a line block the stepper ISR needs for tracing, shared by all segments of the block.
+// This is a copy so the planner can discard the block as soon as all its segments are prepared.
+// The bresenham counts are scaled by 2^MAX_AMASS_LEVEL, segments trace them at any AMASS level.
+typedef struct {
+  uint32_t steps_x, steps_y, steps_z; // Step count along each axis (scaled)
+  uint8_t  direction_bits;            // The direction bit set for this block
+  int32_t  step_event_count;          // The number of step events required to complete this block (scaled)
+} stepper_block_t;
+
+// A run of step events at a constant laser power, prepared from a planner block.
+typedef struct {
+  BLOCK_TYPE block_type;              // Lines trace steps, dwells wait, commands execute on the first event
+  stepper_block_t *st_block;          // Bresenham data of line segments, NULL otherwise
+  uint32_t event_count;               // Number of stepper interrupts in this segment (step events << amass_level)
+  uint8_t amass_level;                // Oversampling of the stepper interrupt (AMASS)
+  uint32_t timer_period;              // Step timer period at the start of this segment (cycles)
+  int8_t ramp;                        // The stepper ISR speeds up (1), slows down (-1) or keeps the rate (0)
+  uint32_t ramp_index;                // Stepper interrupts from standstill to the start rate, at this acceleration
+  uint8_t laser_intensity;            // PWM intensity, velocity and power override applied
+  bool laser_on;                      // Continuous beam
+  bool ppi_pulse;                     // Fire a PPI pulse with the first step event
+  uint32_t line;                      // Sequence number of the G-code line of the block
+#ifdef MOTOR_Z
+  int16_t z_travel;                   // Milliseconds the Z H-bridge runs during the segment, negative is down
+#endif
+} segment_t;
+
+// The real-time state is written by the stepper ISR under a sequence counter (seqlock): it is odd
+// while an update is in progress, readers retry if it was odd or changed while they copied.
+static volatile stepper_state_t stepper_state;
+static volatile uint32_t stepper_state_seq;
 
 // Variables used by The Stepper Driver Interrupt
 static uint8_t out_dir_bits;      // The next direction-bits to be output
 static uint8_t out_step_bits;     // The next stepping-bits to be output
+static bool out_ppi_pulse;        // Fire a PPI pulse with the next step bits
 
 static int32_t counter_x,       // Counter variables for the bresenham line tracer
                counter_y,
                counter_z;
-static uint32_t step_events_completed;        // The number of step events executed in the current block
+static uint32_t st_steps_x,     // Bresenham increments of the current segment (AMASS level applied)
+                st_steps_y,
+                st_steps_z;
+static int8_t st_ramp;          // The ramp of the current segment
+static uint32_t st_ramp_index;  // Stepper interrupts from standstill to the current rate
+static uint32_t st_ramp_period; // The step timer period while ramping (Q8 cycles)
 static volatile uint8_t busy;                 // true whe stepper ISR is in already running
-static double ppi_mm_x = 0;                   // The number of mm travelled in X since last pulse (for PPI)
-static double ppi_mm_y = 0;                   // The number of mm travelled in Y since last pulse (for PPI)
-
-// Variables used by the trapezoid generation
-static uint32_t cycles_per_step_event;        // The number of machine cycles between each step event
-static uint32_t acceleration_tick_counter;    // The cycles since last acceleration_tick.
-                                              // Used to generate ticks at a steady pace without allocating a separate timer.
-static uint32_t adjusted_rate;                // The current rate of step_events according to the speed profile
+static segment_t *current_segment;            // A pointer to the segment currently being executed
+static stepper_block_t *current_st_block;     // The block the current segment belongs to
+static uint8_t laser_intensity = 0;           // The laser setting currently in effect
+static bool laser_on = false;
+static bool laser_restore;                    // re-apply the laser setting (after a safety pause)
 static bool processing_flag;                  // indicates if blocks are being processed
 static volatile bool stop_requested;          // when set to true stepper interrupt will go idle on next entry
 static volatile uint8_t stop_status;          // yields the reason for a stop request
 
-static uint16_t timer_prescaler = 0;
-static uint16_t timer_preload = 0xffff;
+static uint32_t timer_period = 0xffffffff;    // The step timer period in effect (cycles)
+static uint32_t timer_loaded = 0xffffffff;    // The period last loaded, the timer counts from it (cycles)
+
+// The system clock, cached at init. SysCtlClockGet() is too slow for the stepper code.
+static uint32_t cycles_per_second;            // 80MHz
+static uint32_t cycles_per_microsecond;       // 80
+static uint32_t cycles_per_segment;           // 80MHz/400 = 200000, see ACCELERATION_TICKS_PER_SECOND
+
+// Segment ring buffer, filled by the segment prep and consumed by the stepper ISR
+static segment_t segment_buffer[SEGMENT_BUFFER_SIZE];
+static stepper_block_t st_block_buffer[SEGMENT_BUFFER_SIZE];
+static volatile uint8_t segment_buffer_head;  // index of the next segment to be prepared
+static volatile uint8_t segment_buffer_tail;  // index of the segment being executed
+static volatile bool segment_reset_requested; // discard the prepared segments on the next prep
+static volatile HOLD_STATE hold_state;        // feed hold, see HOLD_STATE
+static volatile bool hold_resume;             // the hold was released, replan from standstill
+
+// Variables used by the segment prep (trapezoid generation)
+static block_t *prep_block;                   // The planner block being prepared, NULL if none
+static uint8_t prep_st_block_index;           // The stepper block data of prep_block
+static uint32_t prep_step_events;             // The number of step events prepared of the current block
+static uint32_t prep_rate;                    // The rate after the last prepared step event (steps/min)
+static uint64_t prep_rate_sq;                 // prep_rate^2, exact, the ramps change it by 2*acceleration_st per step
+static uint32_t max_override_rate;            // CONFIG_MAX_SEEKRATE in steps/min, the limit of the overridden rate
+static uint32_t cycles_per_step_event;        // The number of machine cycles between each step event
+static uint32_t prep_timer_period;            // The step timer period for prep_rate
+static uint8_t prep_amass_level;              // The oversampling of the stepper interrupt for prep_rate
+static uint32_t dwell_remaining_us;           // The time left of the current dwell block
+static const uint8_t *raster_dot;             // Raster cursor, the dot being prepared (NULL if none)
+static const uint8_t *raster_dot_last;        // The last dot of the raster row
+static uint8_t raster_dot_on;                 // The dot value that turns the beam on
+static uint32_t raster_dot_end;               // floor(step events up to the end of the dot)
+static uint32_t raster_dot_remainder;         // The remainder (1/length) of raster_dot_end
+static uint32_t raster_dot_step;              // step_event_count/length
+static uint32_t raster_dot_remainder_step;    // step_event_count%length
+static uint8_t prep_laser_intensity;          // The laser setting of the last prepared segment,
+static bool prep_laser_on;                    // kept by commands
+static bool prep_holding;                     // hold_state latched for preparing one segment
+static uint64_t prep_ppi_next;                // PPI: step event position of the next pulse (Q16)
+static uint64_t prep_ppi_interval;            // PPI: step events between pulses (Q16), 0 if not pulsing
+static double prep_ppi_step_mm;               // PPI: XY travel per step event
+static double prep_ppi_travel;                // PPI: travel since the last pulse, carried over from the previous block
+
+// Homing, the cycle is run by the main loop, the stepper ISR stops the axes at the switches
+static HOMING_PHASE homing_phase;             // The move of the homing cycle in progress
+static volatile uint8_t homing_axes;          // The axes still stepping in the homing move (SENSE_STATE_*_LIMIT)
+static uint8_t homing_release;                // The axes stop on the release of their switch (backing off)
+static uint8_t homing_overshoot[2];           // The steps left after the switch of the X and Y axis
+static volatile bool homing_stop;             // All axes are done, absorb the rest of the homing move
+static uint8_t homing_sense_ignore;           // sense_ignore before homing
 
 #ifdef CONFIG_STEPPER_USE_PULSE_TIMER
-static uint8_t pulse_active = 0;
+// The step pulse is ended by the pulse timer (timer B) requesting a uDMA transfer,
+// which writes step_pulse_off to the step pins. The CPU only starts the pulse.
+#define PULSE_DMA_CHANNEL   11   // UDMA_CH11_WTIMER0B
+static tDMAControlTable dma_control_table[PULSE_DMA_CHANNEL + 1] __attribute__ ((aligned(1024)));
+static const uint32_t step_pulse_off = 0;
+static uint32_t pulse_dma_control;  // The channel control word, rewritten to re-arm the channel
 #endif
 
 // prototypes for static functions (non-accesible from other files)
-static bool acceleration_tick();
-static void adjust_speed( uint32_t steps_per_minute );
-static uint32_t config_step_timer(uint32_t cycles);
+static uint8_t next_segment_index(uint8_t index);
+static void segment_prep_isr(void);
+static void segment_buffer_reset(void);
+static void prep_block_start(void);
+static void prep_line_segment(segment_t *segment);
+static void prep_dwell_segment(segment_t *segment);
+static void prep_step_timer(void);
+static void prep_replan_block(void);
+static void prep_override_block(void);
+static void raster_dot_start(void);
+static void raster_dot_advance(void);
+static uint32_t prep_raster_run(uint32_t step_event, uint32_t last_event, uint8_t *intensity);
+static uint32_t prep_ppi_run(uint32_t step_event, uint32_t last_event, bool *pulse);
+static uint32_t isqrt64(uint64_t value);
+static uint32_t rate_cycles(uint32_t steps_per_minute);
+static void set_step_timer(uint32_t period);
+static uint8_t override_intensity(uint8_t intensity);
+static void homing_move(double x, double y, uint8_t release, double rate);
+static void homing_step(void);
 
 volatile double x_steps_per_mm = CONFIG_X_STEPS_PER_MM;
 volatile double y_steps_per_mm = CONFIG_Y_STEPS_PER_MM;
 
-#ifdef CONFIG_STEPPER_USE_PULSE_TIMER
-void pulse_isr(void);
-#endif
-
 void stepper_isr(void);
+ISR_TIMING_WRAPPER(stepper_isr, ISR_TIMING_STEPPER)
+ISR_TIMING_WRAPPER(segment_prep_isr, ISR_TIMING_SEGMENT_PREP)
 
 // Initialize and start the stepper motor subsystem
 void stepper_init() {  
@@ -152,30 +319,47 @@ void stepper_init() {
     GPIOPinWrite(STEP_DIR_PORT, STEP_Z_MASK, 0);
 #endif
 
-    // Configure timer
-    SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER1);
+    // Cache the clock, the stepper code converts rates to cycles a lot
+    cycles_per_second = SysCtlClockGet();
+    cycles_per_microsecond = cycles_per_second / 1000000;
+    cycles_per_segment = cycles_per_second / ACCELERATION_TICKS_PER_SECOND;
+
+    // Configure timer, the wide timer gives two 32 bit halves (no prescaler needed)
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_WTIMER0);
     TimerConfigure(STEPPING_TIMER, TIMER_CFG_SPLIT_PAIR | TIMER_CFG_A_PERIODIC | TIMER_CFG_B_ONE_SHOT);
 
-    TimerIntRegister(STEPPING_TIMER, TIMER_A, stepper_isr);
-    ROM_IntEnable(INT_TIMER1A);
+    TimerIntRegister(STEPPING_TIMER, TIMER_A, ISR_TIMING_HANDLER(stepper_isr));
+    ROM_IntEnable(INT_WTIMER0A);
     TimerIntEnable(STEPPING_TIMER, TIMER_TIMA_TIMEOUT);
-    IntPrioritySet(INT_TIMER1A, CONFIG_STEPPER_PRIORITY);
+    IntPrioritySet(INT_WTIMER0A, CONFIG_STEPPER_PRIORITY);
 
 #ifdef CONFIG_STEPPER_USE_PULSE_TIMER
-    TimerIntRegister(STEPPING_TIMER, TIMER_B, pulse_isr);
-    ROM_IntEnable(INT_TIMER1B);
-    TimerIntEnable(STEPPING_TIMER, TIMER_TIMB_TIMEOUT);
-    IntPrioritySet(INT_TIMER1B, CONFIG_STEPPER_PRIORITY);
+    // The pulse timer raises no interrupt, its timeout triggers the uDMA channel.
+    fastio_timer_load(STEPPING_TIMER, TIMER_B, CONFIG_PULSE_MICROSECONDS * cycles_per_microsecond);
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_UDMA);
+    uDMAEnable();
+    uDMAControlBaseSet(dma_control_table);
+    uDMAChannelAssign(UDMA_CH11_WTIMER0B);
+    uDMAChannelAttributeDisable(PULSE_DMA_CHANNEL, UDMA_ATTR_ALL);
+    uDMAChannelControlSet(PULSE_DMA_CHANNEL | UDMA_PRI_SELECT,
+                          UDMA_SIZE_32 | UDMA_SRC_INC_NONE | UDMA_DST_INC_NONE | UDMA_ARB_1);
+    uDMAChannelTransferSet(PULSE_DMA_CHANNEL | UDMA_PRI_SELECT, UDMA_MODE_BASIC, (void *)&step_pulse_off,
+                           (void *)(STEP_PORT + GPIO_O_DATA + (STEP_MASK << 2)), 1);
+    pulse_dma_control = dma_control_table[PULSE_DMA_CHANNEL].ui32Control;
 #endif
 
-    adjust_speed(MINIMUM_STEPS_PER_MINUTE);
-    clear_vector(stepper_position);
+    // The segment prep is a software triggered interrupt, preempted by the stepper ISR
+    IntRegister(SEGMENT_PREP_INT, ISR_TIMING_HANDLER(segment_prep_isr));
+    IntPrioritySet(SEGMENT_PREP_INT, CONFIG_SEGMENT_PRIORITY);
+    ROM_IntEnable(SEGMENT_PREP_INT);
+
+    prep_timer_period = rate_cycles(MINIMUM_STEPS_PER_MINUTE);
+    set_step_timer(prep_timer_period);
     stepper_set_position( CONFIG_X_ORIGIN_OFFSET,
                           CONFIG_Y_ORIGIN_OFFSET,
                           CONFIG_Z_ORIGIN_OFFSET );
 
-    acceleration_tick_counter = 0;
-    current_block = NULL;
+    segment_buffer_reset();
     stop_requested = false;
     stop_status = GCODE_STATUS_OK;
     busy = false;
@@ -186,26 +370,36 @@ void stepper_init() {
         x_steps_per_mm = CONFIG_X_STEPS_PER_MM * 2.0;
         y_steps_per_mm = CONFIG_Y_STEPS_PER_MM * 2.0;
     }
+    // the same limit the planner puts on the nominal rate of the overridden blocks
+    max_override_rate = ceil(CONFIG_MAX_SEEKRATE * x_steps_per_mm);
 
     // start in the idle state
     // The stepper interrupt gets started when blocks are being added.
     stepper_go_idle();
 
-    // Go Home
+#ifdef CONFIG_DEFER_HOMING
+    // Home on the first motion command, or not at all if the position was saved at shutdown
+    gcode_restore_position();
+#else
+    // Go Home (the main loop runs the homing cycle)
     gcode_do_home();
+#endif
 }
 
 
 // block until all command blocks are executed
 void stepper_synchronize() {
   while(processing_flag) { 
-    // sleep_mode();
+    STEPPER_WAIT();
   }
 }
 
 
 // start processing command blocks
 void stepper_wake_up() {
+  // prepare segments of the new blocks (runs right away, it has a higher priority)
+  IntPendSet(SEGMENT_PREP_INT);
+
   if (!processing_flag) {
     processing_flag = true;
 
@@ -214,21 +408,47 @@ void stepper_wake_up() {
     GPIOPinWrite(STEP_DIR_PORT, STEP_DIR_MASK, STEP_DIR_INVERT);
     GPIOPinWrite(STEP_EN_PORT, STEP_EN_MASK, STEP_EN_MASK ^ STEP_EN_INVERT);
 
+    // The timer would count out the period it stopped with first, 37ms after boot (the
+    // minimum rate), ms after a deceleration. Run the first ISR soon, it loads the segment's.
+    set_step_timer(WAKE_UP_US * cycles_per_microsecond);
+
     // Enable stepper driver interrupt
     TimerEnable(STEPPING_TIMER, TIMER_A);
   }
 }
 
 
+void stepper_prep_hold() {
+  ROM_IntDisable(SEGMENT_PREP_INT);
+}
+
+// a prep requested in between runs now
+void stepper_prep_release() {
+  ROM_IntEnable(SEGMENT_PREP_INT);
+}
+
+
 // stop processing command blocks
 void stepper_go_idle() {
   processing_flag = false;
-  current_block = NULL;
+  current_segment = NULL;
   // Disable stepper driver interrupt
   TimerDisable(STEPPING_TIMER, TIMER_A);
   control_laser(0, 0);
+  laser_on = false;
+  out_ppi_pulse = false;
+#ifdef MOTOR_Z
+  fastio_write(STEP_DIR_PORT, STEP_Z_MASK, 0);
+#endif
 
-  GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_2, 0);
+  stepper_state_seq++;
+  stepper_state.step_cycles = 0;
+  stepper_state.flags = 0;
+  stepper_state_seq++;
+
+#ifdef DEBUG_STEP_LED
+  fastio_write(GPIO_PORTF_BASE, GPIO_PIN_2, 0);
+#endif
 }
 
 // stop event handling
@@ -255,70 +475,97 @@ void stepper_stop_resume() {
 
 
 
+void stepper_get_state(stepper_state_t *state) {
+  uint32_t seq;
+  do {
+    seq = stepper_state_seq;
+    state->position[X_AXIS] = stepper_state.position[X_AXIS];
+    state->position[Y_AXIS] = stepper_state.position[Y_AXIS];
+    state->position[Z_AXIS] = stepper_state.position[Z_AXIS];
+    state->step_cycles = stepper_state.step_cycles;
+    state->block_id = stepper_state.block_id;
+    state->line = stepper_state.line;
+    state->laser_intensity = stepper_state.laser_intensity;
+    state->flags = stepper_state.flags;
+  } while ((seq & 1) || seq != stepper_state_seq);
+}
+
 double stepper_get_position_x() {
-  return stepper_position[X_AXIS]/x_steps_per_mm;
+  return stepper_state.position[X_AXIS]/x_steps_per_mm;
 }
 double stepper_get_position_y() {
-  return stepper_position[Y_AXIS]/y_steps_per_mm;
+  return stepper_state.position[Y_AXIS]/y_steps_per_mm;
 }
 double stepper_get_position_z() {
-  return stepper_position[Z_AXIS]/CONFIG_Z_STEPS_PER_MM;
+  return stepper_state.position[Z_AXIS]/CONFIG_Z_STEPS_PER_MM;
 }
 void stepper_set_position(double x, double y, double z) {
   stepper_synchronize();  // wait until processing is done
-  stepper_position[X_AXIS] = floor(x*x_steps_per_mm + 0.5);
-  stepper_position[Y_AXIS] = floor(y*y_steps_per_mm + 0.5);
-  stepper_position[Z_AXIS] = floor(z*CONFIG_Z_STEPS_PER_MM + 0.5);  
+  stepper_state_seq++;
+  stepper_state.position[X_AXIS] = floor(x*x_steps_per_mm + 0.5);
+  stepper_state.position[Y_AXIS] = floor(y*y_steps_per_mm + 0.5);
+  stepper_state.position[Z_AXIS] = floor(z*CONFIG_Z_STEPS_PER_MM + 0.5);
+  stepper_state_seq++;
 }
 
 
 
-#ifdef CONFIG_STEPPER_USE_PULSE_TIMER
-// Reset the step pulse after a short period completing one step cycle.
-void pulse_isr (void) {
-    // reset step pins
-    GPIOPinWrite(STEP_PORT, STEP_MASK, 0);
-
-    // This is a one-shot timer, so just ACK the IRQ.
-    TimerIntClear(TIMER1_BASE, TIMER_TIMB_TIMEOUT);
-
-    pulse_active = 0;
-}
-#endif // CONFIG_STEPPER_USE_PULSE_TIMER
   
 
 // The Stepper ISR
-// This is the workhorse of LasaurGrbl. It is executed at the rate set with
-// config_step_timer. It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately.
+// This is the workhorse of LasaurGrbl. It is executed at the rate set by the current segment.
+// It pops segments from the segment_buffer and executes them by pulsing the stepper pins appropriately.
 // The bresenham line tracer algorithm controls all three stepper outputs simultaneously.
 void stepper_isr (void) {
-    uint32_t raster_index;
-    uint8_t intensity;
-
+#ifdef CONFIG_ISR_TIMING
+    // the timer reloaded at the timeout, what it counted since is how late we are
+    // (timer_period may have been ramped since the load)
+    isr_timing_step_latency(timer_loaded - fastio_timer_value(STEPPING_TIMER, TIMER_A));
+#endif
     if (busy) { return; } // The busy-flag is used to avoid reentering this interrupt
 
     // Reset the timer
-    TimerLoadSet(STEPPING_TIMER, TIMER_A, timer_preload);
-    TimerIntClear(TIMER1_BASE, TIMER_TIMA_TIMEOUT);
-
-#ifdef CONFIG_STEPPER_USE_PULSE_TIMER
-    if (pulse_active) { return; }   // If the step pulse hasn't completed yet, try again later.
-#endif
+    timer_loaded = timer_period;
+    fastio_timer_load(STEPPING_TIMER, TIMER_A, timer_period);
+    fastio_timer_int_clear(STEPPING_TIMER, TIMER_TIMA_TIMEOUT);
 
     busy = true;
   if (stop_requested) {
+    // the steps computed last aren't sent, take them back out of the position
+    uint8_t dir_bits = out_dir_bits ^ STEP_DIR_INVERT;
+    stepper_state_seq++;
+    if (out_step_bits & (1<<STEP_X_BIT)) {
+      stepper_state.position[X_AXIS] += ((dir_bits >> STEP_X_DIR) & 1) ? 1 : -1;
+    }
+    if (out_step_bits & (1<<STEP_Y_BIT)) {
+      stepper_state.position[Y_AXIS] += ((dir_bits >> STEP_Y_DIR) & 1) ? 1 : -1;
+    }
+    stepper_state_seq++;
+    out_step_bits = 0;
     // go idle and absorb any blocks
+    hold_state = HOLD_NONE;
     stepper_go_idle(); 
     planner_reset_block_buffer();
+    segment_reset_requested = true;
     planner_request_position_update();
     gcode_request_position_update();
     busy = false;
     return;
   }
 
+  if (homing_stop) {
+    // all axes found their switch, drop the rest of the homing move
+    homing_stop = false;
+    stepper_go_idle();
+    planner_reset_block_buffer();
+    segment_reset_requested = true;
+    busy = false;
+    return;
+  }
+
   #ifndef DEBUG_IGNORE_SENSORS
     // stop program when any limit is hit or the e-stop turned the power off
-    if (SENSE_LIMITS && SENSE_LIMITS) {
+    if (SENSE_LIMITS) {
         // Turn off the laser
         control_laser(0, 0);
 
@@ -327,405 +574,825 @@ void stepper_isr (void) {
         return;
     }
 
-    // Pause if we have a (transient) safety issue, will be abrupt and may skip steps...
-    if (SENSE_SAFETY) {
+    // Feed hold if we have a (transient) safety issue, the prepared segments run out
+    // and the segment prep decelerates the head to a stop.
+    if (SENSE_SAFETY && hold_state == HOLD_NONE) {
         // Turn off the laser
         control_laser(0, 0);
-        // Make sure that the rate (laser power) will be set when we resume
-        adjusted_rate = 0;
-        busy = false;
-        return;
+        // Make sure that the laser power will be set when we resume
+        laser_restore = true;
+        hold_state = HOLD_DECELERATING;
+        IntPendSet(SEGMENT_PREP_INT);
     }
   #endif
   
-    GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_2, GPIO_PIN_2);
+#ifdef DEBUG_STEP_LED
+    fastio_write(GPIO_PORTF_BASE, GPIO_PIN_2, GPIO_PIN_2);
+#endif
 
     // pulse steppers
-    GPIOPinWrite(STEP_DIR_PORT, STEP_DIR_MASK, out_dir_bits);
-    GPIOPinWrite(STEP_PORT, STEP_MASK, out_step_bits);
-    out_step_bits = 0;
-    // prime for reset pulse in CONFIG_PULSE_MICROSECONDS
-    //set period
-
+    fastio_write(STEP_DIR_PORT, STEP_DIR_MASK, out_dir_bits);
 #ifdef CONFIG_STEPPER_USE_PULSE_TIMER
-    pulse_active = 1;
-    TimerPrescaleSet(STEPPING_TIMER, TIMER_B, 0);
-    TimerLoadSet(STEPPING_TIMER, TIMER_B, (CONFIG_PULSE_MICROSECONDS - 3) * CYCLES_PER_MICROSECOND);
-    TimerEnable(STEPPING_TIMER, TIMER_B);
+    if (out_step_bits != 0) {
+      // arm the uDMA (a completed basic transfer stops the channel) and start the pulse timer,
+      // which resets the step pins in CONFIG_PULSE_MICROSECONDS
+      dma_control_table[PULSE_DMA_CHANNEL].ui32Control = pulse_dma_control;
+      HWREG(UDMA_ENASET) = 1 << PULSE_DMA_CHANNEL;
+      fastio_timer_int_clear(STEPPING_TIMER, TIMER_TIMB_TIMEOUT);
+      fastio_write(STEP_PORT, STEP_MASK, out_step_bits);
+      fastio_timer_enable(STEPPING_TIMER, TIMER_B);
+    }
+#else
+    fastio_write(STEP_PORT, STEP_MASK, out_step_bits);
 #endif
+    out_step_bits = 0;
+
+    // PPI pulse, fired with the step event it was placed on, the pulse timer ends it
+    if (out_ppi_pulse) {
+      out_ppi_pulse = false;
+      if (hold_state == HOLD_NONE) {
+        control_laser(1, CONFIG_LASER_PPI_PULSE_US);
+      }
+    }
 
-  // If there is no current block, attempt to pop one from the buffer
-  if (current_block == NULL) {
+  // If there is no current segment, attempt to pop one from the buffer
+  if (current_segment == NULL) {
     // Anything in the buffer?
-    current_block = planner_get_current_block();
-    // if still no block command, go idle, disable interrupt
-    if (current_block == NULL) {
-      stepper_go_idle();
+    if (segment_buffer_tail == segment_buffer_head) {
+#ifdef MOTOR_Z
+      fastio_write(STEP_DIR_PORT, STEP_Z_MASK, 0);  // no timed Z run without a segment
+#endif
+      if (hold_state == HOLD_STOPPED) {
+        // held, resume once the safety issue is cleared
+        if (!SENSE_SAFETY) {
+          hold_state = HOLD_NONE;
+          hold_resume = true;
+          IntPendSet(SEGMENT_PREP_INT);
+        }
+      } else if (prep_block == NULL && planner_get_current_block() == NULL) {
+        // all blocks done, go idle, disable interrupt
+        hold_state = HOLD_NONE;
+        stepper_go_idle();
+      } else {
+        // the segment prep fell behind, try again on the next interrupt
+        IntPendSet(SEGMENT_PREP_INT);
+      }
+#ifndef CONFIG_STEPPER_USE_PULSE_TIMER
+      fastio_write(STEP_PORT, STEP_MASK, 0);  // end the last step of the segment
+#endif
       busy = false;
-      return;       
-    }      
-    if (current_block->block_type == BLOCK_TYPE_LINE
-        || current_block->block_type == BLOCK_TYPE_RASTER_LINE) {  // starting on new line block
-      adjusted_rate = current_block->initial_rate;
-      acceleration_tick_counter = CYCLES_PER_ACCELERATION_TICK/2; // start halfway, midpoint rule.
-      adjust_speed( adjusted_rate ); // initialize cycles_per_step_event
-      counter_x = -(current_block->step_event_count >> 1);
+      return;
+    }
+    current_segment = &segment_buffer[segment_buffer_tail];
+    stepper_state_seq++;
+    stepper_state.line = current_segment->line;
+
+    if (current_segment->st_block != NULL && current_segment->st_block != current_st_block) {
+      // starting on new line block
+      current_st_block = current_segment->st_block;
+      stepper_state.block_id++;
+      counter_x = -(current_st_block->step_event_count >> 1);
       counter_y = counter_x;
       counter_z = counter_x;
-      step_events_completed = 0;
-      // If this is a move, or ppi is zero, reset ppi steps (it is only incremented on PPI cuts).
-      if (current_block->laser_pwm == 0 || current_block->laser_mmpp == 0)
-          ppi_mm_x = 0;
-          ppi_mm_y = 0;
     }
+
+    if (current_segment->st_block != NULL) {
+      st_steps_x = current_st_block->steps_x >> current_segment->amass_level;
+      st_steps_y = current_st_block->steps_y >> current_segment->amass_level;
+      st_steps_z = current_st_block->steps_z >> current_segment->amass_level;
+      out_ppi_pulse = current_segment->ppi_pulse;
+    }
+
+    if (current_segment->timer_period != timer_period) {
+      set_step_timer(current_segment->timer_period);
+    }
+    st_ramp = current_segment->ramp;
+    st_ramp_index = current_segment->ramp_index;
+    st_ramp_period = timer_period << RAMP_FRACTION_BITS;
+#ifdef MOTOR_Z
+    // the Z motor runs for the segments of its dwell, the step timer ends it
+    if (current_segment->z_travel < 0) {
+      fastio_write(STEP_DIR_PORT, STEP_Z_MASK, STEP_Z_DOWN);
+    } else if (current_segment->z_travel > 0) {
+      fastio_write(STEP_DIR_PORT, STEP_Z_MASK, STEP_Z_UP);
+    } else {
+      fastio_write(STEP_DIR_PORT, STEP_Z_MASK, 0);
+    }
+#endif
+    laser_restore |= (current_segment->laser_intensity != laser_intensity || current_segment->laser_on != laser_on);
+
+    // publish the segment
+    stepper_state.step_cycles = (current_segment->st_block != NULL) ? timer_period << current_segment->amass_level : 0;
+    stepper_state.laser_intensity = current_segment->laser_intensity;
+#ifdef MOTOR_Z
+    stepper_state.position[Z_AXIS] += current_segment->z_travel;
+#endif
+    stepper_state.flags = STEPPER_STATE_ACTIVE;
+    if (hold_state != HOLD_NONE) {
+      stepper_state.flags |= STEPPER_STATE_HOLD;
+    } else if (current_segment->laser_on) {
+      stepper_state.flags |= STEPPER_STATE_LASER_ON;
+    }
+    stepper_state_seq++;
+
+    switch (current_segment->block_type) {
+      case BLOCK_TYPE_AIR_ASSIST_ENABLE:
+        control_air_assist(true);
+        break;
+      case BLOCK_TYPE_AIR_ASSIST_DISABLE:
+        control_air_assist(false);
+        break;
+      case BLOCK_TYPE_AUX1_ASSIST_ENABLE:
+        control_aux1_assist(true);
+        break;
+      case BLOCK_TYPE_AUX1_ASSIST_DISABLE:
+        control_aux1_assist(false);
+        break;
+      default:
+        break;
+    }
+  }
+
+  // (Re)apply the laser setting of the segment, it stays off during a hold.
+  if (laser_restore && hold_state == HOLD_NONE) {
+    laser_restore = false;
+    laser_intensity = current_segment->laser_intensity;
+    laser_on = current_segment->laser_on;
+    control_laser_intensity(laser_intensity);
+    control_laser(laser_on, 0);
   }
 
-  // process current block, populate out_bits (or handle other commands)
-  switch (current_block->block_type) {
+  // process current segment, populate out_bits
+  switch (current_segment->block_type) {
     case BLOCK_TYPE_RASTER_LINE:
-      raster_index = (step_events_completed * current_block->raster.length) / current_block->step_event_count;
-
-      intensity = 0;
-      if (current_block->raster.invert == 0 && current_block->raster.buffer[raster_index] == '1')
-          intensity = current_block->raster.intensity;
-      else if (current_block->raster.invert != 0 && current_block->raster.buffer[raster_index] == '0')
-          intensity = current_block->raster.intensity;
-
-      if (intensity != current_block->laser_pwm) {
-          current_block->laser_pwm = intensity;
-          control_laser_intensity(intensity);
-          control_laser(intensity, 0);
-      }
-      //break;
     case BLOCK_TYPE_LINE:
       ////// Execute step displacement profile by bresenham line algorithm
-      out_dir_bits = current_block->direction_bits;
-      counter_x += current_block->steps_x;
+      stepper_state_seq++;
+      out_dir_bits = current_st_block->direction_bits;
+      counter_x += st_steps_x;
       if (counter_x > 0) {
         out_step_bits |= (1<<STEP_X_BIT);
-        counter_x -= current_block->step_event_count;
+        counter_x -= current_st_block->step_event_count;
         // also keep track of absolute position
         if ((out_dir_bits >> STEP_X_DIR) & 1 ) {
-          stepper_position[X_AXIS] -= 1;
-          ppi_mm_x -= (1 / x_steps_per_mm);
+          stepper_state.position[X_AXIS] -= 1;
         } else {
-          stepper_position[X_AXIS] += 1;
-          ppi_mm_x += (1 / x_steps_per_mm);
+          stepper_state.position[X_AXIS] += 1;
         }        
       }
-      counter_y += current_block->steps_y;
+      counter_y += st_steps_y;
       if (counter_y > 0) {
         out_step_bits |= (1<<STEP_Y_BIT);
-        counter_y -= current_block->step_event_count;
+        counter_y -= current_st_block->step_event_count;
         // also keep track of absolute position
         if ((out_dir_bits >> STEP_Y_DIR) & 1 ) {
-          stepper_position[Y_AXIS] -= 1;
-          ppi_mm_y -= (1 / y_steps_per_mm);
+          stepper_state.position[Y_AXIS] -= 1;
         } else {
-          stepper_position[Y_AXIS] += 1;
-          ppi_mm_y += (1 / y_steps_per_mm);
+          stepper_state.position[Y_AXIS] += 1;
         }        
       }
 #ifdef STEP_Z_DIR
-      counter_z += current_block->steps_z;
+      counter_z += st_steps_z;
       if (counter_z > 0) {
         out_step_bits |= (1<<STEP_Z_BIT);
-        counter_z -= current_block->step_event_count;
+        counter_z -= current_st_block->step_event_count;
         // also keep track of absolute position        
         if ((out_step_bits >> STEP_Z_DIR) & 1 ) {
-          stepper_position[Z_AXIS] -= 1;
+          stepper_state.position[Z_AXIS] -= 1;
         } else {
-          stepper_position[Z_AXIS] += 1;
+          stepper_state.position[Z_AXIS] += 1;
         }        
       }
-#else
-      if (current_block->steps_z != 0) {
-          if ((out_dir_bits & STEP_Z_MASK) != 0)
-              GPIOPinWrite(STEP_DIR_PORT, STEP_Z_MASK, STEP_Z_DOWN);
-          else
-              GPIOPinWrite(STEP_DIR_PORT, STEP_Z_MASK, STEP_Z_UP);
-          task_enable(TASK_MOTOR_DELAY, (void*)(system_time_ms + (current_block->steps_z)));
-          current_block->steps_z = 0;
-      }
 #endif
+      stepper_state_seq++;
+      if (homing_axes != 0) { homing_step(); }
       //////
-      
-      step_events_completed++;  // increment step count
-      
-      // Send PPI pulse as required.
-      if (current_block->laser_pwm > 0 && current_block->laser_mmpp > 0) {
-          // Use pythagoras to calculate the distance travelled.
-          double travelled = pow(pow(ppi_mm_x, 2) + pow(ppi_mm_y, 2), 0.5);
-
-          if (travelled >= current_block->laser_mmpp) {
-              // Send a laser pulse
-              control_laser(1, CONFIG_LASER_PPI_PULSE_US);
-
-              // Reset distance travelled.
-              ppi_mm_x = 0;
-              ppi_mm_y = 0;
-          }
+
+      // Ramp the period for the next interrupt (the timer reload applies it): c -= 2c/(4n+1)
+      // speeding up, going back the same steps slowing down. Constant acceleration per step.
+      if (st_ramp > 0) {
+        st_ramp_index++;
+        st_ramp_period -= 2 * st_ramp_period / (4 * st_ramp_index + 1);
+        timer_period = st_ramp_period >> RAMP_FRACTION_BITS;
+      } else if (st_ramp < 0 && st_ramp_index > 1 && st_ramp_period < RAMP_PERIOD_MAX) {
+        st_ramp_period += 2 * st_ramp_period / (4 * st_ramp_index - 1);
+        st_ramp_index--;
+        timer_period = st_ramp_period >> RAMP_FRACTION_BITS;
       }
 
       // apply stepper invert mask
       out_dir_bits ^= STEP_DIR_INVERT;
-
-      ////////// SPEED ADJUSTMENT
-      if (step_events_completed < current_block->step_event_count) {  // block not finished
-      
-        // accelerating
-        if (step_events_completed < current_block->accelerate_until) {
-          if ( acceleration_tick() ) {  // scheduled speed change
-            adjusted_rate += current_block->rate_delta;
-            if (adjusted_rate > current_block->nominal_rate) {  // overshot
-              adjusted_rate = current_block->nominal_rate;
-            }
-            adjust_speed( adjusted_rate );
-          }
-        
-        // deceleration start
-        } else if (step_events_completed == current_block->decelerate_after) {
-            // reset counter, midpoint rule
-            // makes sure deceleration is performed the same every time
-            acceleration_tick_counter = CYCLES_PER_ACCELERATION_TICK/2;
-
-        // decelerating
-        } else if (step_events_completed >= current_block->decelerate_after) {
-          if ( acceleration_tick() ) {  // scheduled speed change
-              if (adjusted_rate > current_block->rate_delta)
-                  adjusted_rate -= current_block->rate_delta;
-              else
-                  adjusted_rate = 0;
-            if (adjusted_rate < current_block->final_rate) {  // overshot
-              adjusted_rate = current_block->final_rate;
-            }
-            adjust_speed( adjusted_rate );
-          }
-        
-        // cruising
-        } else {
-          // No accelerations. Make sure we cruise exactly at the nominal rate.
-          if (adjusted_rate != current_block->nominal_rate) {
-            adjusted_rate = current_block->nominal_rate;
-            adjust_speed( adjusted_rate );
-          }
-        }
-      } else {  // block finished
-        current_block = NULL;
-        planner_discard_current_block();
-      }
-      ////////// END OF SPEED ADJUSTMENT
-    
       break; 
 
-    case BLOCK_TYPE_AIR_ASSIST_ENABLE:
-      control_air_assist(true);
-      current_block = NULL;
-      planner_discard_current_block();  
-      break;
-
-    case BLOCK_TYPE_AIR_ASSIST_DISABLE:
-      control_air_assist(false);
-      current_block = NULL;
-      planner_discard_current_block();  
-      break;
-
-    case BLOCK_TYPE_AUX1_ASSIST_ENABLE:
-      control_aux1_assist(true);
-      current_block = NULL;
-      planner_discard_current_block();  
+    default:  // dwells and commands don't step
       break;
+  }
 
-    case BLOCK_TYPE_AUX1_ASSIST_DISABLE:
-      control_aux1_assist(false);
-      current_block = NULL;
-      planner_discard_current_block();  
-      break;    
+  // segment finished, let the segment prep refill the buffer
+  if (--current_segment->event_count == 0) {
+    current_segment = NULL;
+    segment_buffer_tail = next_segment_index(segment_buffer_tail);
+    IntPendSet(SEGMENT_PREP_INT);
   }
 
 #ifndef CONFIG_STEPPER_USE_PULSE_TIMER
-  GPIOPinWrite(STEP_PORT, STEP_MASK, 0);
+  fastio_write(STEP_PORT, STEP_MASK, 0);
 #endif
 
   busy = false;
 }
 
 
+// Returns the index of the next segment in the ring buffer.
+static uint8_t next_segment_index(uint8_t index) {
+  index++;
+  if (index == SEGMENT_BUFFER_SIZE) { index = 0; }
+  return index;
+}
 
 
-// This function determines an acceleration velocity change every CYCLES_PER_ACCELERATION_TICK by
-// keeping track of the number of elapsed cycles during a de/ac-celeration. The code assumes that
-// step_events occur significantly more often than the acceleration velocity iterations.
-static bool acceleration_tick() {
-  acceleration_tick_counter += cycles_per_step_event;
-  if(acceleration_tick_counter > CYCLES_PER_ACCELERATION_TICK) {
-    acceleration_tick_counter -= CYCLES_PER_ACCELERATION_TICK;
-    return true;
-  } else {
-    return false;
+// Drop all prepared segments and the block being prepared.
+static void segment_buffer_reset(void) {
+  segment_reset_requested = false;
+  segment_buffer_head = 0;
+  segment_buffer_tail = 0;
+  current_segment = NULL;
+  current_st_block = NULL;
+  prep_block = NULL;
+  prep_laser_intensity = 0;
+  prep_laser_on = false;
+  hold_state = HOLD_NONE;
+  hold_resume = false;
+  prep_rate = 0;  // the next block starts from standstill
+  prep_rate_sq = 0;
+}
+
+
+// The Segment Prep ISR
+// Triggered by the stepper ISR whenever a segment is done (and on wake up). It takes blocks
+// from the planner and cuts them into segments until the segment buffer is full. This runs at
+// a lower priority than the stepper ISR, so the step timing isn't affected by the speed profile math.
+static void segment_prep_isr(void) {
+  while (true) {
+    if (segment_reset_requested) {
+      segment_buffer_reset();
+    }
+
+    if (hold_resume) {
+      hold_resume = false;
+      if (prep_block != NULL && (prep_block->block_type == BLOCK_TYPE_LINE
+                                 || prep_block->block_type == BLOCK_TYPE_RASTER_LINE)) {
+        prep_replan_block();  // continue the held block from standstill
+      }
+    }
+    prep_holding = (hold_state != HOLD_NONE);
+    if (hold_state == HOLD_STOPPED) { return; }
+
+    uint8_t next_head = next_segment_index(segment_buffer_head);
+    if (next_head == segment_buffer_tail) { return; }  // buffer full
+
+    // If there is no block being prepared, attempt to pop one from the planner
+    if (prep_block == NULL) {
+      prep_block = planner_get_current_block();
+      if (prep_block == NULL) { return; }  // nothing to do
+      prep_block_start();
+    }
+
+    // A hold ends when the head stands still (or at a dwell, which is resumed later).
+    if (prep_holding && (prep_block->block_type == BLOCK_TYPE_DWELL
+                         || ((prep_block->block_type == BLOCK_TYPE_LINE
+                              || prep_block->block_type == BLOCK_TYPE_RASTER_LINE) && prep_rate == 0))) {
+      hold_state = HOLD_STOPPED;
+      return;
+    }
+
+    segment_t *segment = &segment_buffer[segment_buffer_head];
+    segment->block_type = prep_block->block_type;
+    segment->st_block = NULL;
+    segment->event_count = 1;
+    segment->amass_level = 0;
+    segment->timer_period = prep_timer_period;
+    segment->ramp = 0;
+    segment->ramp_index = 0;
+    segment->laser_intensity = prep_laser_intensity;
+    segment->laser_on = prep_laser_on;
+    segment->ppi_pulse = false;
+    segment->line = prep_block->line;
+#ifdef MOTOR_Z
+    segment->z_travel = 0;
+#endif
+
+    switch (prep_block->block_type) {
+      case BLOCK_TYPE_LINE:
+      case BLOCK_TYPE_RASTER_LINE:
+        prep_line_segment(segment);
+        break;
+      case BLOCK_TYPE_DWELL:
+        prep_dwell_segment(segment);
+        break;
+      default:  // commands take a single step event
+        prep_block = NULL;
+        planner_discard_current_block();
+        break;
+    }
+
+    if (segment_reset_requested) { continue; }  // the stepper stopped meanwhile, drop it
+    prep_laser_intensity = segment->laser_intensity;
+    prep_laser_on = segment->laser_on;
+    segment_buffer_head = next_head;
   }
 }
 
 
-// Configures the prescaler and ceiling of timer 1 to produce the given rate as accurately as possible.
-// Returns the actual number of cycles per interrupt.
-static uint32_t config_step_timer(uint32_t cycles) {
-    uint32_t prescaled_cycles = cycles;
+// Set up the segment prep for a block fresh from the planner.
+static void prep_block_start(void) {
+  if (prep_block->block_type == BLOCK_TYPE_LINE
+      || prep_block->block_type == BLOCK_TYPE_RASTER_LINE) {  // starting on new line block
+    stepper_block_t *st_block = &st_block_buffer[prep_st_block_index];
+    st_block->steps_x = prep_block->steps_x << MAX_AMASS_LEVEL;
+    st_block->steps_y = prep_block->steps_y << MAX_AMASS_LEVEL;
+    st_block->steps_z = prep_block->steps_z << MAX_AMASS_LEVEL;
+    st_block->direction_bits = prep_block->direction_bits;
+    st_block->step_event_count = prep_block->step_event_count << MAX_AMASS_LEVEL;
+
+    // PPI: the pulses are placed along the XY path, which advances evenly with the step events,
+    // so the firing points are step events. They stay laser_mmpp apart whatever the speed.
+    prep_ppi_interval = 0;
+    if (prep_block->laser_pwm > 0 && prep_block->laser_mmpp > 0) {
+      double x_mm = prep_block->steps_x / x_steps_per_mm;
+      double y_mm = prep_block->steps_y / y_steps_per_mm;
+      prep_ppi_step_mm = sqrt(x_mm*x_mm + y_mm*y_mm) / prep_block->step_event_count;
+      if (prep_ppi_step_mm > 0) {
+        // at most one pulse per step event
+        prep_ppi_interval = max(llround(prep_block->laser_mmpp / prep_ppi_step_mm * PPI_ONE), PPI_ONE);
+        prep_ppi_next = llround(max(prep_block->laser_mmpp - prep_ppi_travel, 0) / prep_ppi_step_mm * PPI_ONE);
+      }
+    } else {
+      prep_ppi_travel = 0;  // a move or continuous cut, the next PPI cut starts afresh
+    }
+
+    prep_step_events = 0;
+    if (prep_block->feed_override != feed_override) {
+      // not replanned for the feed override yet, enter it at the scaled rate
+      prep_override_block();
+      trapezoid_calculate_block(prep_block, (double)prep_block->initial_rate / prep_block->nominal_rate,
+                                (double)prep_block->final_rate / prep_block->nominal_rate);
+    }
+    if (prep_rate != prep_block->initial_rate) {
+      // The last block didn't exit at the planned entry rate: slower after a feed hold, the
+      // overrides clamped the two rates differently, or the block was planned from the last
+      // one after the prep had taken it. Ramp from the actual rate (once resumed, if held).
+      if (!prep_holding) { prep_replan_block(); }
+    }
+    prep_step_timer(); // initialize cycles_per_step_event
+    if (prep_block->block_type == BLOCK_TYPE_RASTER_LINE) {
+      raster_dot_start();
+    }
+  } else if (prep_block->block_type == BLOCK_TYPE_DWELL) {  // starting a dwell
+    dwell_remaining_us = prep_block->dwell_us;
+  }
+}
 
-    // Temporarily disable the timer
-    ROM_IntDisable(INT_TIMER1A);
 
-    timer_prescaler = 0;
+// Prepare the next segment of a line block: the step events that follow the current segment,
+// up to about one acceleration tick, the next change of the speed profile or raster dot.
+// The rate at its start is exact, the stepper ISR ramps it from there step by step.
+static void prep_line_segment(segment_t *segment) {
+  block_t *block = prep_block;
+  uint32_t step_event_count = block->step_event_count;
+  uint32_t first_event = prep_step_events + 1;
+  uint32_t last_event;
+  uint32_t events;
+  uint32_t rate;
+  uint64_t rate_sq_delta;
+  uint8_t intensity = block->laser_pwm;
+  uint32_t target_rate;
+  int8_t ramp;
+
+  if (block->feed_override != feed_override) {
+    // the feed override changed, ramp from here to the scaled rates
+    prep_override_block();
+    prep_replan_block();
+  }
 
-    while (prescaled_cycles > 65535)
-    {
-        timer_prescaler++;
-        prescaled_cycles = cycles / (1 + timer_prescaler);
+  // the part of the trapezoid the segment is in
+  if (prep_holding || prep_step_events >= block->decelerate_after) {
+    ramp = -1;
+    target_rate = prep_holding ? 0 : block->final_rate;
+    last_event = step_event_count;
+  } else if (prep_step_events < block->accelerate_until) {
+    ramp = (prep_rate > block->nominal_rate) ? -1 : 1;  // down to it, after a lower feed override
+    target_rate = block->nominal_rate;
+    last_event = block->accelerate_until;
+  } else {
+    ramp = 0;
+    target_rate = block->nominal_rate;
+    last_event = block->decelerate_after;
+    if (prep_rate != block->nominal_rate) {  // cruise exactly at the nominal rate
+      prep_rate = block->nominal_rate;
+      prep_rate_sq = (uint64_t)prep_rate * prep_rate;
+      prep_step_timer();
     }
+  }
+  if ((ramp > 0 && prep_rate >= target_rate) || (ramp < 0 && prep_rate <= target_rate)) {
+    ramp = 0;  // already there (rounding)
+  }
+  if (ramp > 0 && prep_rate_sq < block->acceleration_st) {
+    // from standstill, start half a step event into the ramp. The minimum rate would
+    // hold the first step for a slow period and put the ramp index behind the rate.
+    prep_rate_sq = block->acceleration_st;
+    prep_rate = isqrt64(prep_rate_sq);
+    prep_step_timer();
+  }
+  rate = prep_rate;
+  segment->timer_period = prep_timer_period;
+  segment->amass_level = prep_amass_level;
+  segment->ramp = ramp;
+  if (ramp != 0) {
+    // rate^2 = 2*acceleration*n, n step events from standstill (at the rate the timer runs)
+    uint32_t timer_rate = max(rate, MINIMUM_STEPS_PER_MINUTE);
+    // (scaled to interrupts before the division, a few steps in it would round to 0)
+    uint64_t n = (((uint64_t)timer_rate * timer_rate << prep_amass_level) + block->acceleration_st)
+                 / (2 * (uint64_t)block->acceleration_st);
+    segment->ramp_index = min(n, RAMP_INDEX_MAX);
+  }
 
-    timer_preload = prescaled_cycles;
+  // Limit the segment to about one acceleration tick so the overrides apply quickly.
+  last_event = min(last_event, first_event + max(cycles_per_segment / cycles_per_step_event, 1) - 1);
+  if (block->block_type == BLOCK_TYPE_RASTER_LINE) {
+    last_event = prep_raster_run(first_event, last_event, &intensity);
+  }
+  if (prep_ppi_interval > 0) {
+    last_event = prep_ppi_run(first_event, last_event, &segment->ppi_pulse);
+  }
+  events = last_event - first_event + 1;
+  prep_step_events = last_event;
+
+  segment->st_block = &st_block_buffer[prep_st_block_index];
+  segment->event_count = events << segment->amass_level;
+
+  // the exact rate after the segment starts the next one
+  rate_sq_delta = 2 * (uint64_t)block->acceleration_st * events;
+  uint64_t target_rate_sq = (uint64_t)target_rate * target_rate;
+  if (ramp > 0) {
+    prep_rate_sq = min(prep_rate_sq + rate_sq_delta, target_rate_sq);
+  } else if (ramp < 0) {
+    prep_rate_sq = (prep_rate_sq > target_rate_sq + rate_sq_delta) ? prep_rate_sq - rate_sq_delta : target_rate_sq;
+  }
+  if (ramp != 0) {
+    prep_rate = isqrt64(prep_rate_sq);
+    prep_step_timer();
+  }
+
+  // The laser power follows the speed (not using PPI)
+  if (prep_holding) {
+    intensity = 0;
+    segment->laser_on = false;
+    segment->ppi_pulse = false;
+  } else if (block->laser_mmpp == 0) {
+    // beam dynamics, fraction of nominal rate in 1/256
+    uint32_t rate_fraction = ((uint64_t)rate * block->nominal_rate_inverse) >> 24;
+    intensity = min((intensity * rate_fraction) >> 8, 255);
+    segment->laser_on = (intensity > 0);
+  } else {
+    segment->laser_on = false;  // pulsed by the stepper ISR
+  }
+  segment->laser_intensity = override_intensity(intensity);
 
-    //set period
-    TimerPrescaleSet(STEPPING_TIMER, TIMER_A, timer_prescaler);
-    TimerLoadSet(STEPPING_TIMER, TIMER_A, timer_preload);
+  if (prep_step_events == step_event_count) {  // block finished
+    if (prep_ppi_interval > 0) {
+      // the travel since the last pulse carries over to the next block
+      double ahead = (double)(prep_ppi_next - ((uint64_t)step_event_count << PPI_FRACTION_BITS)) / PPI_ONE;
+      prep_ppi_travel = block->laser_mmpp - ahead * prep_ppi_step_mm;
+    }
+    if (prep_rate > block->final_rate) {
+      // the ramp down ends about a step event above the exit rate, the next block enters at it
+      prep_rate = block->final_rate;
+      prep_rate_sq = (uint64_t)prep_rate * prep_rate;
+    }
+    prep_st_block_index = next_segment_index(prep_st_block_index);
+    prep_block = NULL;
+    planner_discard_current_block();
+  }
+}
 
-    // Re-Enable the Timer
-    ROM_IntEnable(INT_TIMER1A);
 
-    return(timer_preload * (1 + timer_prescaler));
+// Prepare the next segment of a dwell: hold the beam for one timer chunk,
+// then turn it off before the next block starts.
+static void prep_dwell_segment(segment_t *segment) {
+  if (dwell_remaining_us > 0) {
+    uint32_t chunk_us = min(dwell_remaining_us, DWELL_CHUNK_US);
+    dwell_remaining_us -= chunk_us;
+    segment->timer_period = chunk_us * cycles_per_microsecond;
+    segment->laser_intensity = override_intensity(prep_block->laser_pwm);
+    segment->laser_on = (prep_block->laser_pwm > 0);
+#ifdef MOTOR_Z
+    if (prep_block->z_motor != 0) {  // Z steps are milliseconds of running
+      segment->z_travel = (prep_block->z_motor == STEP_Z_DOWN) ? -(chunk_us / 1000) : (chunk_us / 1000);
+    }
+#endif
+  } else {  // dwell finished
+    segment->timer_period = DWELL_RELEASE_US * cycles_per_microsecond;
+    segment->laser_on = false;
+    prep_block = NULL;
+    planner_discard_current_block();
+  }
 }
 
 
-static void adjust_speed( uint32_t steps_per_minute ) {
-  // steps_per_minute is typicaly just adjusted_rate
-  if (steps_per_minute < MINIMUM_STEPS_PER_MINUTE) { steps_per_minute = MINIMUM_STEPS_PER_MINUTE; }
-  cycles_per_step_event = config_step_timer( (CYCLES_PER_MICROSECOND*1000000/steps_per_minute) * 60 );
+// Replan the rest of the current line block to ramp from prep_rate, after a feed hold or
+// a feed override. Above the nominal rate the first ramp slows down to it. The exit rate
+// is kept, unless it can't be reached anymore.
+static void prep_replan_block(void) {
+  block_t *block = prep_block;
+  block_t rest = *block;
+
+  rest.step_event_count = block->step_event_count - prep_step_events;
+  if (prep_rate > block->nominal_rate) {
+    uint64_t rate_sq_step = 2 * (uint64_t)block->acceleration_st;
+    uint64_t nominal_rate_sq = (uint64_t)block->nominal_rate * block->nominal_rate;
+    uint64_t final_rate_sq = (uint64_t)block->final_rate * block->final_rate;
+    uint32_t slow_down = min((prep_rate_sq - nominal_rate_sq + rate_sq_step - 1) / rate_sq_step, rest.step_event_count);
+    uint32_t decelerate = min((nominal_rate_sq - final_rate_sq) / rate_sq_step, rest.step_event_count);
+    rest.accelerate_until = slow_down;
+    rest.decelerate_after = max(rest.step_event_count - decelerate, slow_down);
+  } else {
+    trapezoid_calculate_block(&rest, (double)prep_rate / block->nominal_rate,
+                              (double)block->final_rate / block->nominal_rate);
+  }
+  block->accelerate_until = prep_step_events + rest.accelerate_until;
+  block->decelerate_after = prep_step_events + rest.decelerate_after;
+}
+
+
+// Scale the rates of the current line block to the feed override. The planner enters the
+// next block at its scaled entry rate, which is where this one exits now. The caller replans
+// the trapezoid, the head ramps to the new rates at the planned acceleration.
+static void prep_override_block(void) {
+  block_t *block = prep_block;
+  uint8_t override = feed_override;
+  // the limit the planner puts on the overridden rates, but not below the planned rate
+  uint32_t nominal_rate = min((uint64_t)block->nominal_rate * override / block->feed_override,
+                              max(max_override_rate, block->nominal_rate));
+
+  nominal_rate = max(nominal_rate, 1);
+  block->initial_rate = min((uint64_t)block->initial_rate * override / block->feed_override, nominal_rate);
+  block->final_rate = min((uint64_t)block->final_rate * override / block->feed_override, nominal_rate);
+  block->nominal_rate = nominal_rate;
+  block->nominal_rate_inverse = (nominal_rate <= 1) ? UINT32_MAX : ((uint64_t)1 << 32) / nominal_rate;
+  block->feed_override = override;
+}
+
+
+// Compute the step timer setting for prep_rate. At low rates the timer is oversampled (AMASS).
+static void prep_step_timer(void) {
+  uint32_t timer_rate = prep_rate;
+  uint32_t cycles;
+
+  if (timer_rate < MINIMUM_STEPS_PER_MINUTE) { timer_rate = MINIMUM_STEPS_PER_MINUTE; }
+  cycles = rate_cycles(timer_rate);
+
+  prep_amass_level = 0;
+#ifdef CONFIG_STEPPER_AMASS
+  if (cycles > AMASS_LEVEL1) {
+    if (cycles > AMASS_LEVEL3) { prep_amass_level = 3; }
+    else if (cycles > AMASS_LEVEL2) { prep_amass_level = 2; }
+    else { prep_amass_level = 1; }
+  }
+#endif
+  prep_timer_period = cycles >> prep_amass_level;
+  cycles_per_step_event = prep_timer_period << prep_amass_level;
 
   if (cycles_per_step_event == 0)
   {
       control_laser(0, 0);
       stepper_request_stop(GCODE_STATUS_BAD_NUMBER_FORMAT);
+      cycles_per_step_event = 1;
   }
+}
 
-  // This can be called from init, so make sure we don't dereference a NULL block.
-  if (current_block != NULL)
-  {
-      uint8_t constrained_intensity = current_block->laser_pwm;
-      if (current_block->laser_mmpp == 0) {
-          // beam dynamics (not using PPI)
-          uint8_t adjusted_intensity = current_block->laser_pwm *
-                                       ((float)steps_per_minute/(float)current_block->nominal_rate);
-          constrained_intensity = max(adjusted_intensity, 0);
-          control_laser(constrained_intensity, 0);
-      }
-      control_laser_intensity(constrained_intensity);
+
+// Put the raster cursor on the first dot of the block. Step event n shows dot
+// (n-1)*length/step_event_count, the dot boundaries are tracked bresenham style.
+static void raster_dot_start(void) {
+  uint32_t length = prep_block->raster.length;
+
+  raster_dot = NULL;
+  if (length == 0) { return; }
+
+  raster_dot = prep_block->raster.buffer;
+  raster_dot_last = raster_dot + length - 1;
+  raster_dot_on = (prep_block->raster.invert == 0) ? '1' : '0';
+  raster_dot_step = prep_block->step_event_count / length;
+  raster_dot_remainder_step = prep_block->step_event_count % length;
+  raster_dot_end = raster_dot_step;
+  raster_dot_remainder = raster_dot_remainder_step;
+}
+
+
+// Move the raster cursor to the next dot. The last step event on the dot is
+// raster_dot_end, plus one if there is a remainder.
+static void raster_dot_advance(void) {
+  raster_dot++;
+  raster_dot_end += raster_dot_step;
+  raster_dot_remainder += raster_dot_remainder_step;
+  if (raster_dot_remainder >= prep_block->raster.length) {
+    raster_dot_remainder -= prep_block->raster.length;
+    raster_dot_end++;
   }
 }
 
 
-static int homing_cycle(bool x_axis, bool y_axis, bool z_axis, bool reverse_direction, uint32_t microseconds_per_pulse) {
-  int ret = 0;
-  uint32_t timeout = system_time_ms + STEP_HOME_TIMEOUT;
-  uint32_t step_delay = microseconds_per_pulse - CONFIG_PULSE_MICROSECONDS;
-  uint8_t out_dir_bits = STEP_DIR_MASK;
-  uint8_t limit_bits;
-  uint8_t x_overshoot_count = 24;
-  uint8_t y_overshoot_count = 24;
-  uint8_t z_overshoot_count = 24;
+// Find the last step event (not beyond last_event) of the run of raster dots with
+// the same intensity as the dot of step_event. The intensity is returned as well.
+static uint32_t prep_raster_run(uint32_t step_event, uint32_t last_event, uint8_t *intensity) {
+  uint32_t dot_last_event;
+  bool on;
 
-  if (x_axis) { out_step_bits |= (1<<STEP_X_BIT); }
-  if (y_axis) { out_step_bits |= (1<<STEP_Y_BIT); }
-  if (z_axis) { out_step_bits |= (1<<STEP_Z_BIT); }
-  
-  // Invert direction bits if this is a reverse homing_cycle
-  if (reverse_direction) {
-    out_dir_bits ^= STEP_DIR_MASK;
+  if (raster_dot == NULL) {
+    *intensity = 0;
+    return last_event;
   }
-  
-  // Apply the global invert mask
-  out_dir_bits ^= STEP_DIR_INVERT;
-  
-  // Set direction pins
-  GPIOPinWrite(STEP_DIR_PORT, STEP_DIR_MASK, out_dir_bits);
-  
-  for(;;) {
 
-    limit_bits = (SENSE_X_LIMIT)?0x01:0;
-    limit_bits |= (SENSE_Y_LIMIT)?0x02:0;
-    limit_bits |= (SENSE_Z_LIMIT)?0x04:0;
+  // the dot shown at step_event
+  dot_last_event = raster_dot_end + (raster_dot_remainder != 0);
+  while (step_event > dot_last_event && raster_dot < raster_dot_last) {
+    raster_dot_advance();
+    dot_last_event = raster_dot_end + (raster_dot_remainder != 0);
+  }
+  on = (*raster_dot == raster_dot_on);
+  *intensity = on ? prep_block->raster.intensity : 0;
+
+  // and the following dots of the same intensity
+  while (dot_last_event < last_event && raster_dot < raster_dot_last
+         && (raster_dot[1] == raster_dot_on) == on) {
+    raster_dot_advance();
+    dot_last_event = raster_dot_end + (raster_dot_remainder != 0);
+  }
+  return min(dot_last_event, last_event);
+}
 
-    if (reverse_direction) {         
-      // Invert limit_bits if this is a reverse homing_cycle
-      limit_bits ^= 0x07;
-    }
-    if (x_axis && (limit_bits & 0x01)) {
-      if(x_overshoot_count == 0) {
-        x_axis = false;
-        out_step_bits ^= (1<<STEP_X_BIT);
-      } else {
-        x_overshoot_count--;
-      }     
-    } 
-    if (y_axis && (limit_bits & 0x02)) {
-      if(y_overshoot_count == 0) {
-        y_axis = false;
-        out_step_bits ^= (1<<STEP_Y_BIT);
-      } else {
-        y_overshoot_count--;
-      }        
+
+// PPI: the pulse fires on the first step event of a segment, so a segment ends before the
+// next firing point. Returns the last step event (not beyond last_event) of the segment
+// starting at step_event, and whether it fires a pulse.
+static uint32_t prep_ppi_run(uint32_t step_event, uint32_t last_event, bool *pulse) {
+  // the first step event whose travel reaches the pulse position
+  uint32_t pulse_event = max((prep_ppi_next + PPI_ONE - 1) >> PPI_FRACTION_BITS, 1);
+
+  *pulse = (pulse_event <= step_event);
+  while (pulse_event <= step_event) {
+    prep_ppi_next += prep_ppi_interval;
+    pulse_event = (prep_ppi_next + PPI_ONE - 1) >> PPI_FRACTION_BITS;
+  }
+  return min(last_event, pulse_event - 1);
+}
+
+
+// Integer square root (floor), bit by bit.
+static uint32_t isqrt64(uint64_t value) {
+  uint64_t root = 0;
+  uint64_t bit = 1ULL << 62;
+
+  while (bit > value) { bit >>= 2; }
+  while (bit != 0) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
     }
-    if (z_axis && (limit_bits & 0x04)) {
-      if(z_overshoot_count == 0) {
-        z_axis = false;
-        out_step_bits ^= (1<<STEP_Z_BIT);
-      } else {
-        z_overshoot_count--;
-      }
+    bit >>= 2;
+  }
+  return root;
+}
+
+
+// The step period (cycles) for a rate in steps/minute. Cycles per minute don't fit 32 bits,
+// so the division is split in an integer and a fractional part (two hardware divides).
+static uint32_t rate_cycles(uint32_t steps_per_minute) {
+  return (cycles_per_second / steps_per_minute) * 60
+         + (cycles_per_second % steps_per_minute) * 60 / steps_per_minute;
+}
+
+
+// Sets the period of the step timer, starting from the current interrupt.
+static void set_step_timer(uint32_t period) {
+    timer_period = period;
+    timer_loaded = period;
+    fastio_timer_load(STEPPING_TIMER, TIMER_A, timer_period);
+}
+
+
+// Scale a laser intensity by the power override.
+static uint8_t override_intensity(uint8_t intensity) {
+  uint32_t scaled = (uint32_t)intensity * power_override / 100;
+  return min(scaled, 255);
+}
+
+
+// Start the homing cycle. It runs from the main loop (stepper_homing_update), after the
+// blocks queued before it are done.
+void stepper_homing_start() {
+  homing_phase = HOMING_START;
+}
+
+// Queue the next move of the homing cycle, returns HOMING_RESULT_RUNNING until the cycle is over.
+// The head ends up HOMING_OVERSHOOT steps past the release point of the switches,
+// this is the new origin. If homing fails the limit switches are ignored.
+uint8_t stepper_homing_update() {
+  uint8_t result = HOMING_RESULT_DONE;
+
+  if (homing_phase == HOMING_IDLE) { return HOMING_RESULT_DONE; }
+  if (processing_flag) { return HOMING_RESULT_RUNNING; }  // the move (or the queued blocks) is still running
+
+  if (stop_requested || homing_axes != 0) {
+    // stopped, or a switch wasn't found or didn't release within the move
+    if (homing_phase != HOMING_START) {
+      sense_ignore = stop_requested ? homing_sense_ignore : 1;
     }
-    if(x_axis || y_axis || z_axis) {
-        // step all axes still in out_bits
-        GPIOPinWrite(STEP_PORT, STEP_MASK, out_step_bits);
-        __delay_us(CONFIG_PULSE_MICROSECONDS);
-        GPIOPinWrite(STEP_PORT, STEP_MASK, 0);
-        __delay_us(step_delay);
-    } else { 
+    homing_axes = 0;
+    homing_phase = HOMING_IDLE;
+    result = HOMING_RESULT_FAILED;
+  } else {
+    switch (homing_phase) {
+      case HOMING_START:
+#ifdef DEBUG_IGNORE_SENSORS
+        homing_phase = HOMING_IDLE;
+#else
+        // the limit switches stop the axes, don't let them stop the machine
+        homing_sense_ignore = sense_ignore;
+        sense_ignore = 1;
+        homing_move(-HOMING_TRAVEL_X, -HOMING_TRAVEL_Y, 0, CONFIG_HOMING_SEEKRATE);
+        homing_phase = HOMING_APPROACH;
+#endif
         break;
-    }
-
-    // Homing timeout
-    if (timeout < system_time_ms) {
-        ret = -1;
+      case HOMING_APPROACH:
+        homing_move(CONFIG_HOMING_PULLOFF, CONFIG_HOMING_PULLOFF, HOMING_AXES, CONFIG_HOMING_SEEKRATE);
+        homing_phase = HOMING_BACK_OFF;
+        break;
+      case HOMING_BACK_OFF:
+        homing_move(-CONFIG_HOMING_PULLOFF, -CONFIG_HOMING_PULLOFF, 0, CONFIG_HOMING_FEEDRATE);
+        homing_phase = HOMING_LOCATE;
+        break;
+      case HOMING_LOCATE:
+        homing_move(CONFIG_HOMING_PULLOFF, CONFIG_HOMING_PULLOFF, HOMING_AXES, CONFIG_HOMING_FEEDRATE);
+        homing_phase = HOMING_PULL_OFF;
+        break;
+      default:
+        sense_ignore = homing_sense_ignore;
+        homing_phase = HOMING_IDLE;
         break;
     }
+  }
 
+  if (homing_phase == HOMING_IDLE) {
+    stepper_set_position(0.0, 0.0, 0.0);
+    return result;
   }
-  clear_vector(stepper_position);
-  return ret;
+  return HOMING_RESULT_RUNNING;
 }
 
-int stepper_homing_cycle() {
-    int ret = 0;
-#ifndef DEBUG_IGNORE_SENSORS
-    stepper_synchronize();
-    // home the x and y axis
+bool stepper_homing_active() {
+  return homing_phase != HOMING_IDLE;
+}
 
-    // Home X and Y quickly.
-    ret = homing_cycle(true, true, false, false, 50);
-    if (ret == 0)
-        ret = homing_cycle(true, true, false, true, 50);
+// Queue a homing move of the X and Y axis (mm, relative). The axes step until their switch
+// triggers, or releases if they are in release (SENSE_STATE_*_LIMIT bits).
+static void homing_move(double x, double y, uint8_t release, double rate) {
+  homing_release = release;
+  homing_overshoot[X_AXIS] = HOMING_OVERSHOOT;
+  homing_overshoot[Y_AXIS] = HOMING_OVERSHOOT;
+  homing_axes = HOMING_AXES;
+  homing_stop = false;
+  planner_set_position(0.0, 0.0, 0.0);
+  planner_line(x, y, 0.0, rate, CONFIG_DEFAULT_ACCELERATION, 0, 0);
+}
 
-    // Perform a slow (accurate) home.
-    if (ret == 0)
-        ret = homing_cycle(true, true, false, false, 1000);
-    if (ret == 0)
-        ret = homing_cycle(true, true, false, true, 1000);
-#endif
+// Called by the stepper ISR for each step event of a homing move. Reads the switches directly,
+// the latched state clears only after the debounce time.
+static void homing_step(void) {
+  uint8_t triggered = (sense_read() ^ homing_release) & homing_axes;
 
-    // If homing failed, ignore the limit switches.
-    if (ret != 0)
-        sense_ignore = 1;
+  if ((triggered & SENSE_STATE_X_LIMIT) && (out_step_bits & (1<<STEP_X_BIT))) {
+    if (homing_overshoot[X_AXIS] == 0) {
+      homing_axes &= ~SENSE_STATE_X_LIMIT;
+    } else {
+      homing_overshoot[X_AXIS]--;
+    }
+  }
+  if ((triggered & SENSE_STATE_Y_LIMIT) && (out_step_bits & (1<<STEP_Y_BIT))) {
+    if (homing_overshoot[Y_AXIS] == 0) {
+      homing_axes &= ~SENSE_STATE_Y_LIMIT;
+    } else {
+      homing_overshoot[Y_AXIS]--;
+    }
+  }
 
-    return ret;
+  // axes that are done stand still for the rest of the move
+  if (!(homing_axes & SENSE_STATE_X_LIMIT)) { out_step_bits &= ~(1<<STEP_X_BIT); }
+  if (!(homing_axes & SENSE_STATE_Y_LIMIT)) { out_step_bits &= ~(1<<STEP_Y_BIT); }
+  if (homing_axes == 0) { homing_stop = true; }
 }
 
 
@@ -39,6 +39,15 @@ void stepper_init(void);
 
 // Block until all buffered steps are executed
 void stepper_synchronize(void);
+
+// The main loop spins here while it waits for the stepper. The host builds (host/)
+// have no interrupts, they run the step timer from here.
+#ifdef HOST_BUILD
+void host_wait_for_interrupt(void);
+#define STEPPER_WAIT() host_wait_for_interrupt()
+#else
+#define STEPPER_WAIT()
+#endif
              
 // Start stepper interrupt and execute the blocks in queue.
 void stepper_wake_up(void);
@@ -46,12 +55,34 @@ void stepper_wake_up(void);
 // make the stepper subsystem fall asleep
 void stepper_go_idle(void);
 
+// Keep the segment prep from taking blocks while the planner swaps in new trapezoids.
+// Only for a few us, the segment buffer may hold no more than a block end.
+void stepper_prep_hold(void);
+void stepper_prep_release(void);
+
 // stop (error) functions
 void stepper_request_stop(uint8_t status);
 uint8_t stepper_stop_status(void);
 bool stepper_stop_requested(void);
 void stepper_stop_resume(void);
 
+// The real-time machine state, published by the stepper ISR.
+typedef struct {
+  int32_t position[3];        // absolute position (steps)
+  uint32_t step_cycles;       // cycles per step event of the current segment, 0 if not moving
+  uint32_t block_id;          // counts the line blocks started
+  uint32_t line;              // sequence number of the G-code line being executed (planner_set_line_number)
+  uint8_t laser_intensity;    // 0-255 is 0-100%
+  uint8_t flags;              // STEPPER_STATE_*
+} stepper_state_t;
+
+#define STEPPER_STATE_ACTIVE    0x01  // processing blocks
+#define STEPPER_STATE_LASER_ON  0x02
+#define STEPPER_STATE_HOLD      0x04  // in a feed hold
+
+// Get a consistent copy of the real-time state, without disabling interrupts.
+void stepper_get_state(stepper_state_t *state);
+
 // Get the actual position of the head in mm.
 // This is as accurate as an open loop system can be.
 double stepper_get_position_x(void);
@@ -59,8 +90,15 @@ double stepper_get_position_y(void);
 double stepper_get_position_z(void);
 void stepper_set_position(double x, double y, double z);
 
-// perform the homing cycle
-int stepper_homing_cycle(void);
+// Homing cycle, started here and run by the main loop (TASK_HOMING) calling
+// stepper_homing_update() while it returns HOMING_RESULT_RUNNING. Motion commands must wait for it.
+#define HOMING_RESULT_RUNNING   0
+#define HOMING_RESULT_DONE      1
+#define HOMING_RESULT_FAILED    2   // stopped, or a switch wasn't found or didn't release
+
+void stepper_homing_start(void);
+uint8_t stepper_homing_update(void);
+bool stepper_homing_active(void);
 
 uint8_t stepper_active(void);
 
@@ -38,6 +38,7 @@
 #include "sense_control.h"
 #include "lcd.h"
 #include "joystick.h"
+#include "isr_timing.h"
 
 
 static volatile task_t task_status = 0;
@@ -50,7 +51,9 @@ void gp_timer_isr(void) {
 	TimerLoadSet64(GP_TIMER, timer_load);
 	TimerIntClear(GP_TIMER, TIMER_TIMA_TIMEOUT);
 	system_time_ms++;
+	sense_debounce_tick();
 }
+ISR_TIMING_WRAPPER(gp_timer_isr, ISR_TIMING_GP_TIMER)
 
 void tasks_init(void) {
 	task_status = 0;
@@ -62,7 +65,7 @@ void tasks_init(void) {
 	// Create a 1ms timer
 	timer_load = SysCtlClockGet() / 1000;
 	TimerLoadSet64(GP_TIMER, timer_load);
-	TimerIntRegister(GP_TIMER, TIMER_A, gp_timer_isr);
+	TimerIntRegister(GP_TIMER, TIMER_A, ISR_TIMING_HANDLER(gp_timer_isr));
 	TimerIntEnable(GP_TIMER, TIMER_TIMA_TIMEOUT);
 	IntPrioritySet(INT_TIMER4A, CONFIG_GPTIMER_PRIORITY);
 
@@ -87,6 +90,7 @@ uint8_t task_running(TASK task) {
 
 void tasks_loop(void) {
 	uint8_t serial_active = 0;
+	uint32_t status_report_time = 0;
 #ifdef ENABLE_LCD
 	double last_x = 0;
 	double last_y = 0;
@@ -127,7 +131,7 @@ void tasks_loop(void) {
 		// Process manual moves
     	if (task_running(TASK_MANUAL_MOVE)) {
     		struct task_manual_move_data *move = task_data[TASK_MANUAL_MOVE];
-    		if (planner_blocks_available() >= PLANNER_FIFO_READY_THRESHOLD) {
+    		if (planner_blocks_available() >= PLANNER_FIFO_READY_THRESHOLD && !task_running(TASK_HOMING)) {
     			gcode_manual_move(move->x_offset, move->y_offset, move->z_offset, move->rate);
     			task_disable(TASK_MANUAL_MOVE);
     		}
@@ -139,12 +143,31 @@ void tasks_loop(void) {
 			task_disable(TASK_SET_OFFSET);
     	}
 
-		// Z Motor Run
-    	if (task_running(TASK_MOTOR_DELAY)) {
-    		if (system_time_ms > (uint32_t)task_data[TASK_MOTOR_DELAY])
-    		{
-    			GPIOPinWrite(STEP_DIR_PORT, GPIO_PIN_5 | GPIO_PIN_7, 0);
-    			task_disable(TASK_MOTOR_DELAY);
+		// Replan the queue after a feed override
+    	if (task_running(TASK_PLANNER_OVERRIDE)) {
+    		task_disable(TASK_PLANNER_OVERRIDE);
+    		planner_apply_overrides();
+    	}
+
+		// Periodic status report, the period (ms) is the task data
+    	if (task_running(TASK_STATUS_REPORT)) {
+    		uint32_t period = (uintptr_t)task_data[TASK_STATUS_REPORT];
+    		if (system_time_ms - status_report_time >= period) {
+    			// keep the pace, unless the loop fell behind by more than a period
+    			status_report_time += period;
+    			if (system_time_ms - status_report_time >= period) {
+    				status_report_time = system_time_ms;
+    			}
+    			gcode_status_report();
+    		}
+    	}
+
+		// Homing cycle, queues its moves one after another
+    	if (task_running(TASK_HOMING)) {
+    		uint8_t homing = stepper_homing_update();
+    		if (homing != HOMING_RESULT_RUNNING) {
+    			task_disable(TASK_HOMING);
+    			gcode_homing_done(homing == HOMING_RESULT_DONE);
     		}
     	}
 
@@ -153,9 +176,11 @@ void tasks_loop(void) {
     	if (task_running(TASK_UPDATE_LCD)) {
     		if (system_time_ms % 500 == 0)
     		{
-    			double x = stepper_get_position_x();
-    			double y = stepper_get_position_y();
-    			double z = stepper_get_position_z();
+    			stepper_state_t state;
+    			stepper_get_state(&state);
+    			double x = state.position[X_AXIS] / x_steps_per_mm;
+    			double y = state.position[Y_AXIS] / y_steps_per_mm;
+    			double z = state.position[Z_AXIS] / CONFIG_Z_STEPS_PER_MM;
 
     			double *offsets = gcode_get_offsets();
 
@@ -217,6 +242,9 @@ void tasks_loop(void) {
 			// Allow Joystick control
 			joystick_enable();
     	}
+
+		// Send what was printed without a closing newline
+		serial_flush();
 	}
 }
 
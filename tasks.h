@@ -29,7 +29,9 @@ typedef enum {
 	TASK_SERIAL_RX,
 	TASK_MANUAL_MOVE,
 	TASK_SET_OFFSET,
-	TASK_MOTOR_DELAY,
+	TASK_PLANNER_OVERRIDE,
+	TASK_HOMING,
+	TASK_STATUS_REPORT,
 #ifdef ENABLE_LCD
 	TASK_UPDATE_LCD,
 #endif
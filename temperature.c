@@ -35,6 +35,7 @@
 #include "config.h"
 
 #include "temperature.h"
+#include "isr_timing.h"
 
 #define OW_DELAY_A 6
 #define OW_DELAY_B 64
@@ -320,6 +321,7 @@ void temperature_update_isr(void) {
 
 	TimerIntClear(SENSE_TIMER, TIMER_TIMA_TIMEOUT);
 }
+ISR_TIMING_WRAPPER(temperature_update_isr, ISR_TIMING_TEMPERATURE)
 
 void temperature_init(void) {
 	int rom;
@@ -365,7 +367,7 @@ void temperature_init(void) {
 	// Don't bother starting the timer if no sensors were found
 	if (num_sensors > 0)
 	{
-		TimerIntRegister(SENSE_TIMER, TIMER_A, temperature_update_isr);
+		TimerIntRegister(SENSE_TIMER, TIMER_A, ISR_TIMING_HANDLER(temperature_update_isr));
 		TimerEnable(SENSE_TIMER, TIMER_A);
 	}
 }
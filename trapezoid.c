@@ -0,0 +1,324 @@
+/*
+  trapezoid.c - velocity profile math shared by the planner and the time estimator
+  Part of LasaurGrbl
+
+  Copyright (c) 2009-2011 Simen Svale Skogsrud
+  Copyright (c) 2011 Sungeun K. Jeon
+  Copyright (c) 2011 Stefan Hechenberger
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+// This file must not depend on any hardware (driverlib) so that it can be
+// built for the host as well as for the target.
+
+#include <math.h>
+#include <stdlib.h>
+#include "trapezoid.h"
+#include "config.h"
+
+
+// prototypes for static functions (non-accesible from other files)
+static uint8_t next_index(uint8_t index, uint8_t size);
+static uint8_t prev_index(uint8_t index, uint8_t size);
+static double estimate_acceleration_distance(double initial_rate, double target_rate, double acceleration);
+static double intersection_distance(double initial_rate, double final_rate, double acceleration, double distance);
+static void reduce_entry_speed_reverse(block_t *current, block_t *next);
+static void reduce_entry_speed_forward(block_t *previous, block_t *current);
+static double ramp_seconds(uint32_t steps, double *rate, double acceleration, double limit_rate);
+
+
+// Returns the index of the next block in a ring buffer.
+static uint8_t next_index(uint8_t index, uint8_t size) {
+  index++;
+  if (index == size) { index = 0; }  // cheaper than module (%)
+  return index;
+}
+
+// Returns the index of the previous block in a ring buffer.
+static uint8_t prev_index(uint8_t index, uint8_t size) {
+  if (index == 0) { index = size; }
+  index--;
+  return index;
+}
+
+
+/*            target rate -> +
+**                          /|
+**                         / |                 
+**                        /  |   
+**                       /   |
+**      initial rate -> +----+           
+**                           ^                   
+**                           |                   
+**                       DISTANCE 
+*/
+// Calculates the distance (not time) it takes to accelerate from initial_rate to target_rate
+static double estimate_acceleration_distance(double initial_rate, double target_rate, double acceleration) {
+  return( (target_rate*target_rate-initial_rate*initial_rate)/(2*acceleration) );
+}
+
+
+
+/*                        + <- some maximum rate we don't care about
+**                       /|\
+**                      / | \                    
+**                     /  |  + <- final_rate     
+**                    /   |  |                   
+**   initial_rate -> +----+--+                   
+**                        ^  ^                   
+**                        |  |                   
+**    INTERSECTION_DISTANCE  distance
+*/
+// This function gives you the point at which you must start braking (at the rate of -acceleration) if 
+// you started at speed initial_rate and accelerated until this point and want to end at the final_rate after
+// a total travel of distance. This can be used to compute the intersection point between acceleration and
+// deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
+static double intersection_distance(double initial_rate, double final_rate, double acceleration, double distance) {
+  return( (2*acceleration*distance-initial_rate*initial_rate+final_rate*final_rate)/(4*acceleration) );
+}
+
+            
+
+/*                      + <- MAX_ALLOWABLE_SPEED
+**                      |\
+**                      | \                    
+**                      |  \    
+**                      |   \                  
+**                      +----+ <- target velocity            
+**                           ^                   
+**                           |                   
+**                       distance 
+*/
+// Calculate the beginning speed that results in target_velocity when accelerated over given distance.
+double trapezoid_max_allowable_speed(double acceleration, double target_velocity, double distance) {
+  return( sqrt(target_velocity*target_velocity-2*acceleration*distance) );
+}
+
+
+
+/*                                        
+**                                   +--------+   <- nominal_rate
+**                                  /|        |\                                
+**  nominal_rate*entry_factor ->   + |        | \                               
+**                                 | |        |  + <- nominal_rate*exit_factor  
+**                                 +-+--------+--+                              
+**                                   ^        ^
+**                                   |        |
+**                      accelerate_until    decelerate_after                           
+*/                                                                              
+// Calculates accelerate_until and decelerate_after.
+void trapezoid_calculate_block(block_t *block, double entry_factor, double exit_factor) {
+  block->initial_rate = ceil(block->nominal_rate * entry_factor);  // (step/min)
+  block->final_rate = ceil(block->nominal_rate * exit_factor);     // (step/min)
+  double acceleration_per_minute = block->acceleration_st; // (step/min^2)
+  int32_t accelerate_steps = 
+    ceil(estimate_acceleration_distance(block->initial_rate, block->nominal_rate, acceleration_per_minute));
+  int32_t decelerate_steps = 
+    floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration_per_minute));
+    
+  // Calculate the size of Plateau of Nominal Rate. 
+  int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
+  
+  // Handle special case where we don't reach a plateau.
+  if (plateau_steps < 0) {  
+    accelerate_steps = ceil( intersection_distance( block->initial_rate, block->final_rate, 
+                             acceleration_per_minute, block->step_event_count ) );
+    accelerate_steps = max(accelerate_steps, 0);  // check limits due to numerical round-off
+    accelerate_steps = min(accelerate_steps, block->step_event_count);
+    plateau_steps = 0;
+  }  
+  
+  block->accelerate_until = accelerate_steps;
+  block->decelerate_after = accelerate_steps+plateau_steps;
+}
+
+
+static void reduce_entry_speed_reverse(block_t *current, block_t *next) {
+  // 'next' here is the newer/later block, not the next in the iteration
+  //                   time->
+  //     [tail][][][current][next][][][][head] -> loops around to tail
+  //     processing ->                  queuing->
+  //  
+  // Reduce entry_speed if necessary so next entry_speed can definitely be reached with
+  // fixed acceleration. This is specifically relevant for short blocks that never plateau.
+  // Skip if we already flagged the block as plateauing or vmax <= next entry_speed. 
+  // The deceleration happens in the current block, with its acceleration.
+  if ((!current->nominal_length_flag) && (current->vmax_junction > next->entry_speed)) {
+    current->entry_speed = min( current->vmax_junction, trapezoid_max_allowable_speed(
+                  -current->acceleration, next->entry_speed, current->millimeters) );
+  } else {
+    current->entry_speed = current->vmax_junction;
+  } 
+  current->recalculate_flag = true;
+  // no worries about last block, forward pass takes care of it
+}
+
+
+static void reduce_entry_speed_forward(block_t *previous, block_t *current) {
+  // 'previous' here is the older/earlier block, not the previous in the iteration
+  //                   time->
+  //     [tail][][][previous][current][][][][head] -> loops around to tail
+  //     processing ->                  queuing->
+  //  
+  // Reduce entry_speed if necessary so it can be reached from previous entry_speed  with
+  // fixed acceleration. This is specifically relevant for short blocks that never plateau.
+  // Skip if we already flagged the previous block as plateauing or entry_speed <= previous entry_speed.   
+  // The acceleration happens in the previous block, with its acceleration.
+  if (!previous->nominal_length_flag) {
+    if (previous->entry_speed < current->entry_speed) {
+      double entry_speed = min( current->entry_speed,
+        trapezoid_max_allowable_speed(-previous->acceleration, previous->entry_speed, previous->millimeters) );
+      // Check for junction speed change
+      if (current->entry_speed != entry_speed) {
+        current->entry_speed = entry_speed;
+        current->recalculate_flag = true;
+      }
+    }    
+  }
+}
+
+
+// Replan the entry speeds of the blocks in the ring buffer[tail..head), the entry speed of
+// the tail block is kept. The blocks whose trapezoid changes are flagged (recalculate_flag).
+void trapezoid_plan_speeds(block_t *buffer, uint8_t size, uint8_t tail, uint8_t head) {
+  if (tail == head) { return; }  // nothing to plan
+
+  //// reverse pass
+  // Recalculate entry_speed to be (a) less or equal to vmax_junction and
+  // (b) low enough so it can definitely reach the next entry_speed at fixed acceleration.
+  uint8_t block_index = head;
+  block_t *previous = NULL;  // block closer to tail (older)
+  block_t *current = NULL;   // block who's entry_speed to be adjusted
+  block_t *next = NULL;      // block closer to head (newer)
+  while(block_index != tail) {
+    block_index = prev_index(block_index, size);
+    next = current;
+    current = previous;
+    previous = &buffer[block_index];
+    if (current && next) {
+      reduce_entry_speed_reverse(current, next);
+    }
+  } // skip tail/first block
+  
+  //// forward pass
+  // Recalculate entry_speed to be low enough it can definitely 
+  // be reached from previous entry_speed at fixed acceleration.
+  block_index = tail;
+  previous = NULL;  // block closer to tail (older)
+  current = NULL;   // block who's entry_speed to be adjusted
+  next = NULL;      // block closer to head (newer)
+  while(block_index != head) {
+    previous = current;
+    current = next;
+    next = &buffer[block_index];
+    if (previous && current) {
+      reduce_entry_speed_forward(previous, current);
+    }
+    block_index = next_index(block_index, size);
+  }
+  if (current && next) {
+    reduce_entry_speed_forward(current, next);
+  }
+}
+
+
+// Recalculate the plan for the blocks in the ring buffer[tail..head), called whenever a new block was added.
+// The tail block is not modified (it may be executing), only its exit speed.
+// All planner computations are performed with doubles (float on Arduinos) to minimize numerical round-
+// off errors. Only when planned values are converted to stepper rate parameters, these are integers.
+void trapezoid_recalculate(block_t *buffer, uint8_t size, uint8_t tail, uint8_t head) {
+  if (tail == head) { return; }  // nothing to plan
+  trapezoid_plan_speeds(buffer, size, tail, head);
+
+  //// recalculate trapeziods for all flagged blocks
+  // At this point all blocks have entry_speeds that that can be (a) reached from the prevous
+  // entry_speed with the one and only acceleration from our settings and (b) have junction
+  // speeds that do not exceed our limits for given direction change.
+  // Now we only need to calculate the actual accelerate_until and decelerate_after values.
+  uint8_t block_index = tail;
+  block_t *current = NULL;
+  block_t *next = NULL;
+  while(block_index != head) {
+    current = next;
+    next = &buffer[block_index];
+    if (current && current->block_type != BLOCK_TYPE_DWELL) {
+      if (current->recalculate_flag || next->recalculate_flag) {
+        trapezoid_calculate_block( current, 
+            current->entry_speed/current->nominal_speed, 
+            next->entry_speed/current->nominal_speed );      
+        current->recalculate_flag = false;
+      }
+    }
+    block_index = next_index(block_index, size);
+  }
+  // always recalculate last (newest) block with zero exit speed
+  if (next->block_type != BLOCK_TYPE_DWELL) {
+    trapezoid_calculate_block( next, 
+      next->entry_speed/next->nominal_speed, ZERO_SPEED/next->nominal_speed );
+  }
+  next->recalculate_flag = false;
+}
+
+
+
+// Time (seconds) for a number of steps at a constant acceleration (step/min^2, negative slows
+// down) as the stepper runs it: rate^2 changes by 2*acceleration each step. Once limit_rate is
+// reached the remaining steps run at it. rate is updated.
+static double ramp_seconds(uint32_t steps, double *rate, double acceleration, double limit_rate) {
+  double end_rate_sq = (*rate) * (*rate) + 2 * acceleration * steps;
+  double limit_rate_sq = limit_rate * limit_rate;
+  double end_rate;
+  double seconds = 0.0;
+
+  if (steps == 0) { return 0.0; }
+  if ((acceleration > 0) ? end_rate_sq > limit_rate_sq : end_rate_sq < limit_rate_sq) {
+    // the limit is reached early
+    double ramp_steps = (limit_rate_sq - (*rate) * (*rate)) / (2 * acceleration);
+    ramp_steps = min(max(ramp_steps, 0.0), (double)steps);
+    seconds = (steps - ramp_steps) * 60.0 / max(limit_rate, MINIMUM_STEPS_PER_MINUTE);
+    end_rate = (ramp_steps > 0) ? limit_rate : *rate;
+  } else {
+    end_rate = sqrt(end_rate_sq);
+  }
+  seconds += (end_rate - *rate) / acceleration * 60.0;
+  *rate = end_rate;
+  return seconds;
+}
+
+
+// The time (seconds) it takes the stepper to execute a block with its current trapezoid:
+// acceleration until accelerate_until, nominal_rate until decelerate_after, then
+// deceleration to final_rate.
+double trapezoid_block_seconds(const block_t *block) {
+  if (block->block_type == BLOCK_TYPE_DWELL) {
+    return block->dwell_us / 1000000.0;
+  }
+  if (block->block_type != BLOCK_TYPE_LINE && block->block_type != BLOCK_TYPE_RASTER_LINE) {
+    return 0.0;  // commands take no time
+  }
+
+  uint32_t steps = block->step_event_count;
+  uint32_t accelerate_until = min(block->accelerate_until, steps);
+  uint32_t decelerate_after = max(min(block->decelerate_after, steps), accelerate_until);
+  double acceleration = block->acceleration_st;
+  double rate = block->initial_rate;
+  double seconds = 0.0;
+
+  seconds += ramp_seconds(accelerate_until, &rate, acceleration, block->nominal_rate);
+  if (decelerate_after > accelerate_until) {
+    rate = block->nominal_rate;
+    seconds += (decelerate_after - accelerate_until) * 60.0 / max(rate, MINIMUM_STEPS_PER_MINUTE);
+  }
+  seconds += ramp_seconds(steps - decelerate_after, &rate, -acceleration, block->final_rate);
+
+  return seconds;
+}
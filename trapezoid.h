@@ -0,0 +1,41 @@
+/*
+  trapezoid.h - velocity profile math shared by the planner and the time estimator
+  Part of LasaurGrbl
+
+  Copyright (c) 2009-2011 Simen Svale Skogsrud
+  Copyright (c) 2011 Sungeun K. Jeon
+  Copyright (c) 2011 Stefan Hechenberger
+
+  LasaurGrbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  LasaurGrbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#ifndef trapezoid_h
+#define trapezoid_h
+
+#include <stdint.h>
+#include "planner.h"
+
+// Calculate the beginning speed that results in target_velocity when accelerated over given distance.
+double trapezoid_max_allowable_speed(double acceleration, double target_velocity, double distance);
+
+// Calculates initial_rate, final_rate, accelerate_until and decelerate_after of a block.
+void trapezoid_calculate_block(block_t *block, double entry_factor, double exit_factor);
+
+// Replan the entry speeds of the blocks in the ring buffer[tail..head), the tail block's is kept.
+void trapezoid_plan_speeds(block_t *buffer, uint8_t size, uint8_t tail, uint8_t head);
+
+// Replan the junction speeds and trapezoids of the blocks in the ring buffer[tail..head).
+void trapezoid_recalculate(block_t *buffer, uint8_t size, uint8_t tail, uint8_t head);
+
+// The time in seconds the stepper needs to execute a planned block.
+double trapezoid_block_seconds(const block_t *block);
+
+#endif